@@ -0,0 +1,831 @@
+/*
+  Load generator for the event manager. Opens many client connections,
+  replays a mix of Ping, CallEntrypoint and RemoteOutput commands with the
+  same framing as event_manager_run(), and reports throughput and latency
+  percentiles.
+
+  Without -R the load is closed-loop: every connection keeps -n requests in
+  flight. With -R the requests are sent at a fixed total rate and latency is
+  measured from the time they were scheduled, so a stalled server is not
+  hidden by the generator slowing down with it.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "networking.h"
+#include "sha256.h"
+
+#define MAX_THREADS 64
+#define MAX_SETUP_CONNECTIONS 64
+#define RX_SIZE 4096
+#define TAG_SIZE 16
+
+typedef enum {
+  Request_Ping,
+  Request_Call,
+  Request_Remote,
+  Request_Count
+} RequestType;
+
+static const char *request_names[Request_Count] = { "ping", "call", "remote" };
+
+typedef struct samples {
+  uint32_t *ns;         // latency of every request, clamped to ~4 s
+  size_t len;
+  size_t cap;
+} Samples;
+
+typedef struct bench_conn {
+  int fd;
+  unsigned char rx[RX_SIZE];
+  size_t rx_len;
+  uint64_t *sent;       // send (or schedule) times of the in-flight requests
+  uint8_t *types;
+  unsigned int head;
+  unsigned int inflight;
+  uint64_t next_send;   // paced mode only
+} BenchConn;
+
+typedef struct bench_thread {
+  pthread_t thread;
+  BenchConn *conns;
+  int num_conns;
+  Samples samples[Request_Count];
+  uint64_t errors;
+  uint32_t rng;
+} BenchThread;
+
+typedef struct setup_connection {
+  uint16_t conn_id;
+  uint16_t to_sm;
+  int local;
+  struct in_addr address;
+  uint16_t port;
+} SetupConnection;
+
+static struct {
+  const char *host;
+  uint16_t port;
+  int num_conns;
+  int num_threads;
+  unsigned int depth;
+  double duration;
+  double rate;                  // requests per second, 0 for closed-loop
+  unsigned int weights[Request_Count];
+  uint16_t module_id;
+  uint16_t entrypoint;
+  uint16_t conn_id;             // RemoteOutput connection
+  size_t payload_size;
+  const char *ta_path;
+  const char *ta_uuid;
+  int server_stats;
+  SetupConnection setup[MAX_SETUP_CONNECTIONS];
+  int num_setup;
+} opt = {
+  .host = "127.0.0.1",
+  .port = 1236,
+  .num_conns = 16,
+  .num_threads = 1,
+  .depth = 1,
+  .duration = 10,
+  .weights = { 1, 0, 0 },
+  .module_id = 1,
+  .entrypoint = 3,
+  .payload_size = 16,
+};
+
+static unsigned char *frames[Request_Count];
+static size_t frame_lens[Request_Count];
+static uint64_t end_time;
+
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static void die(const char *msg) {
+  perror(msg);
+  exit(EXIT_FAILURE);
+}
+
+
+static void put_u16(unsigned char *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+
+static void put_u32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xFF;
+  p[2] = (v >> 8) & 0xFF;
+  p[3] = v & 0xFF;
+}
+
+
+/*
+  Build a [CommandCode u8 - length - payload] frame, the length is 32 bits
+  for LoadSM and 16 bits otherwise
+
+  @return: frame allocated with malloc, its size in len
+*/
+static unsigned char *make_frame(CommandCode code, const unsigned char *payload,
+                                  size_t size, size_t *len) {
+  size_t length_size = code == CommandCode_LoadSM ? 4 : 2;
+  unsigned char *frame;
+
+  if(length_size == 2 && size > 0xFFFF) {
+    fprintf(stderr, "payload of %zu bytes does not fit a frame\n", size);
+    exit(EXIT_FAILURE);
+  }
+
+  frame = malloc(1 + length_size + size);
+  if(frame == NULL)
+    die("malloc");
+
+  frame[0] = code;
+  if(length_size == 4)
+    put_u32(frame + 1, size);
+  else
+    put_u16(frame + 1, size);
+
+  if(size > 0)
+    memcpy(frame + 1 + length_size, payload, size);
+  *len = 1 + length_size + size;
+  return frame;
+}
+
+
+static void build_frames(void) {
+  size_t size = opt.payload_size;
+  unsigned char *payload = malloc(4 + size + TAG_SIZE);
+
+  if(payload == NULL)
+    die("malloc");
+
+  frames[Request_Ping] = make_frame(CommandCode_Ping, NULL, 0,
+                                      &frame_lens[Request_Ping]);
+
+  // [module id u16 - entrypoint u16 - data]
+  put_u16(payload, opt.module_id);
+  put_u16(payload + 2, opt.entrypoint);
+  memset(payload + 4, 'x', size);
+  frames[Request_Call] = make_frame(CommandCode_CallEntrypoint, payload,
+                                      4 + size, &frame_lens[Request_Call]);
+
+  // [module id u16 - conn id u16 - cipher - tag]
+  put_u16(payload + 2, opt.conn_id);
+  memset(payload + 4 + size, 't', TAG_SIZE);
+  frames[Request_Remote] = make_frame(CommandCode_RemoteOutput, payload,
+                                        4 + size + TAG_SIZE,
+                                        &frame_lens[Request_Remote]);
+  free(payload);
+}
+
+
+static int connect_server(void) {
+  struct sockaddr_in address;
+  int one = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if(fd < 0)
+    die("socket");
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(opt.port);
+  if(inet_pton(AF_INET, opt.host, &address.sin_addr) != 1) {
+    fprintf(stderr, "invalid address %s\n", opt.host);
+    exit(EXIT_FAILURE);
+  }
+
+  if(connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0)
+    die("connect");
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+
+static void send_all(int fd, const unsigned char *buf, size_t len) {
+  while(len > 0) {
+    ssize_t n = send(fd, buf, len, 0);
+
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      die("send");
+    }
+
+    buf += n;
+    len -= n;
+  }
+}
+
+
+static void recv_all(int fd, unsigned char *buf, size_t len) {
+  while(len > 0) {
+    ssize_t n = recv(fd, buf, len, 0);
+
+    if(n == 0) {
+      fprintf(stderr, "connection closed by the server\n");
+      exit(EXIT_FAILURE);
+    }
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      die("recv");
+    }
+
+    buf += n;
+    len -= n;
+  }
+}
+
+
+// Send one setup command and wait for its result
+static int setup_command(int fd, CommandCode code, const unsigned char *payload,
+                          size_t size) {
+  unsigned char header[3];
+  unsigned char skip[256];
+  size_t len;
+  unsigned char *frame = make_frame(code, payload, size, &len);
+
+  send_all(fd, frame, len);
+  free(frame);
+
+  recv_all(fd, header, 3);
+  for(size_t left = (header[1] << 8) | header[2]; left > 0; ) {
+    size_t n = left < sizeof(skip) ? left : sizeof(skip);
+
+    recv_all(fd, skip, n);
+    left -= n;
+  }
+
+  return header[0];
+}
+
+
+static uint64_t get_u64(const unsigned char *p) {
+  uint64_t v = 0;
+
+  for(int i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+
+  return v;
+}
+
+
+/*
+  Print the stage latencies measured by the server, see stats_serialize().
+  They are reset first, so that they only cover the run
+*/
+static void server_stats(int reset) {
+  static const char *stages[] = { "decode", "lookup", "invoke", "demux",
+                                   "send" };
+  const size_t record = 1 + 6 * 8;
+  unsigned char flags = reset;
+  unsigned char header[3];
+  unsigned char *payload;
+  size_t len;
+  int fd = connect_server();
+  unsigned char *frame = make_frame(CommandCode_Stats, &flags, 1, &len);
+
+  send_all(fd, frame, len);
+  free(frame);
+
+  recv_all(fd, header, 3);
+  len = (header[1] << 8) | header[2];
+  payload = malloc(len + 1);
+  if(payload == NULL)
+    die("malloc");
+  recv_all(fd, payload, len);
+  close(fd);
+
+  if(header[0] != ResultCode_Ok) {
+    fprintf(stderr, "Stats failed with result %d\n", header[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if(reset) {
+    free(payload);
+    return;
+  }
+
+  printf("\n%-8s %10s %10s %10s %10s %10s %10s\n", "stage", "count",
+          "p50 us", "p90 us", "p99 us", "p999 us", "max us");
+
+  for(size_t off = 0; off + record <= len; off += record) {
+    unsigned char *p = payload + off;
+    const char *name = p[0] < sizeof(stages) / sizeof(stages[0]) ?
+                          stages[p[0]] : "?";
+
+    printf("%-8s %10llu", name, (unsigned long long) get_u64(p + 1));
+    for(int i = 2; i < 7; i++)
+      printf(" %10.1f", get_u64(p + 1 + 8 * (i - 1)) / 1000.0);
+    printf("\n");
+  }
+
+  free(payload);
+}
+
+
+// "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx" to the 16 bytes LoadSM expects
+static int parse_uuid(const char *str, unsigned char *uuid) {
+  int n = 0;
+
+  for(const char *p = str; *p != '\0'; p++) {
+    unsigned int byte;
+
+    if(*p == '-')
+      continue;
+    if(n == 16 || sscanf(p, "%2x", &byte) != 1 || p[1] == '\0')
+      return 0;
+
+    uuid[n++] = byte;
+    p++;
+  }
+
+  return n == 16;
+}
+
+
+static void load_ta(int fd) {
+  FILE *file = fopen(opt.ta_path, "rb");
+  unsigned char *payload;
+  long size;
+
+  if(file == NULL)
+    die(opt.ta_path);
+
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  // [module id u16 - uuid - TA binary]
+  payload = malloc(18 + size);
+  if(payload == NULL)
+    die("malloc");
+
+  put_u16(payload, opt.module_id);
+  if(!parse_uuid(opt.ta_uuid, payload + 2)) {
+    fprintf(stderr, "invalid uuid %s\n", opt.ta_uuid);
+    exit(EXIT_FAILURE);
+  }
+
+  if(fread(payload + 18, 1, size, file) != (size_t) size)
+    die(opt.ta_path);
+  fclose(file);
+
+  // [module id u16 - uuid - SHA-256]: the binary is only sent if the server
+  // does not have it installed already
+  unsigned char cached[18 + SHA256_SIZE];
+
+  memcpy(cached, payload, 18);
+  sha256(payload + 18, size, cached + 18);
+
+  int code = setup_command(fd, CommandCode_LoadCachedSM, cached, sizeof(cached));
+  if(code == ResultCode_BadRequest)
+    code = setup_command(fd, CommandCode_LoadSM, payload, 18 + size);
+  free(payload);
+
+  if(code != ResultCode_Ok) {
+    fprintf(stderr, "LoadSM failed with result %d\n", code);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+static void setup(void) {
+  int fd = connect_server();
+
+  if(opt.ta_path != NULL)
+    load_ta(fd);
+
+  // [conn id u16 - to module u16 - local u8 - port u16 - address]
+  for(int i = 0; i < opt.num_setup; i++) {
+    SetupConnection *c = &opt.setup[i];
+    unsigned char payload[11];
+
+    put_u16(payload, c->conn_id);
+    put_u16(payload + 2, c->to_sm);
+    payload[4] = c->local;
+    put_u16(payload + 5, c->port);
+    memcpy(payload + 7, &c->address, 4);
+
+    int code = setup_command(fd, CommandCode_AddConnection, payload, 11);
+    if(code != ResultCode_Ok)
+      fprintf(stderr, "AddConnection %d failed with result %d\n",
+                c->conn_id, code);
+  }
+
+  close(fd);
+}
+
+
+static RequestType pick_request(BenchThread *t) {
+  unsigned int total = 0, r;
+
+  for(int i = 0; i < Request_Count; i++)
+    total += opt.weights[i];
+
+  // xorshift32
+  t->rng ^= t->rng << 13;
+  t->rng ^= t->rng >> 17;
+  t->rng ^= t->rng << 5;
+  r = t->rng % total;
+
+  for(int i = 0; i < Request_Count; i++) {
+    if(r < opt.weights[i])
+      return i;
+    r -= opt.weights[i];
+  }
+
+  return Request_Ping;
+}
+
+
+static void record(Samples *s, uint64_t ns) {
+  if(s->len == s->cap) {
+    size_t cap = s->cap == 0 ? 65536 : s->cap * 2;
+    uint32_t *ns_buf = realloc(s->ns, cap * sizeof(uint32_t));
+
+    if(ns_buf == NULL)
+      die("realloc");
+
+    s->ns = ns_buf;
+    s->cap = cap;
+  }
+
+  s->ns[s->len++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+
+static void send_request(BenchThread *t, BenchConn *c, uint64_t when) {
+  RequestType type = pick_request(t);
+  unsigned int slot = (c->head + c->inflight) % opt.depth;
+
+  c->sent[slot] = when;
+  c->types[slot] = type;
+  c->inflight++;
+  send_all(c->fd, frames[type], frame_lens[type]);
+}
+
+
+// Match the complete results in the receive buffer to the oldest requests
+static void handle_results(BenchThread *t, BenchConn *c, uint64_t now) {
+  size_t offset = 0;
+
+  while(c->rx_len - offset >= 3) {
+    unsigned char *header = c->rx + offset;
+    size_t len = 3 + ((header[1] << 8) | header[2]);
+
+    if(c->rx_len - offset < len)
+      break;
+
+    if(c->inflight == 0) {
+      fprintf(stderr, "unexpected result from the server\n");
+      exit(EXIT_FAILURE);
+    }
+
+    if(header[0] != ResultCode_Ok)
+      t->errors++;
+
+    record(&t->samples[c->types[c->head]], now - c->sent[c->head]);
+    c->head = (c->head + 1) % opt.depth;
+    c->inflight--;
+    offset += len;
+  }
+
+  memmove(c->rx, c->rx + offset, c->rx_len - offset);
+  c->rx_len -= offset;
+}
+
+
+static void *bench_thread(void *arg) {
+  BenchThread *t = arg;
+  struct epoll_event events[64];
+  uint64_t interval = 0;
+  int epoll_fd = epoll_create1(0);
+
+  if(epoll_fd < 0)
+    die("epoll_create1");
+
+  // every connection gets the same share of the total rate
+  if(opt.rate > 0)
+    interval = 1e9 * opt.num_conns / opt.rate;
+
+  uint64_t start = now_ns();
+  for(int i = 0; i < t->num_conns; i++) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &t->conns[i] };
+
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, t->conns[i].fd, &ev) < 0)
+      die("epoll_ctl");
+
+    t->conns[i].next_send = start + (interval * i) / t->num_conns;
+  }
+
+  while(1) {
+    uint64_t now = now_ns();
+    int timeout = 100;
+
+    if(now >= end_time)
+      break;
+
+    for(int i = 0; i < t->num_conns; i++) {
+      BenchConn *c = &t->conns[i];
+
+      if(interval == 0) {
+        while(c->inflight < opt.depth)
+          send_request(t, c, now_ns());
+        continue;
+      }
+
+      while(c->inflight < opt.depth && c->next_send <= now) {
+        send_request(t, c, c->next_send);
+        c->next_send += interval;
+      }
+    }
+
+    if(interval != 0)
+      timeout = 1;
+
+    int n = epoll_wait(epoll_fd, events, 64, timeout);
+    if(n < 0 && errno != EINTR)
+      die("epoll_wait");
+
+    now = now_ns();
+    for(int i = 0; i < n; i++) {
+      BenchConn *c = events[i].data.ptr;
+      ssize_t len = recv(c->fd, c->rx + c->rx_len, RX_SIZE - c->rx_len,
+                          MSG_DONTWAIT);
+
+      if(len == 0) {
+        fprintf(stderr, "connection closed by the server\n");
+        exit(EXIT_FAILURE);
+      }
+      if(len < 0) {
+        if(errno == EAGAIN || errno == EINTR)
+          continue;
+        die("recv");
+      }
+
+      c->rx_len += len;
+      handle_results(t, c, now);
+    }
+  }
+
+  close(epoll_fd);
+  return NULL;
+}
+
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+
+static double percentile_us(Samples *s, double p) {
+  size_t i = (size_t) (p * s->len);
+
+  if(i >= s->len)
+    i = s->len - 1;
+
+  return s->ns[i] / 1000.0;
+}
+
+
+static void merge(Samples *dst, Samples *src) {
+  for(size_t i = 0; i < src->len; i++)
+    record(dst, src->ns[i]);
+}
+
+
+static void report_line(const char *name, Samples *s, double seconds) {
+  if(s->len == 0)
+    return;
+
+  qsort(s->ns, s->len, sizeof(uint32_t), compare_u32);
+  printf("%-8s %10zu %12.1f %10.1f %10.1f %10.1f %10.1f\n", name, s->len,
+          s->len / seconds, percentile_us(s, 0.5), percentile_us(s, 0.99),
+          percentile_us(s, 0.999), s->ns[s->len - 1] / 1000.0);
+}
+
+
+static void report(BenchThread *threads, double seconds) {
+  Samples all = { 0 };
+  uint64_t errors = 0;
+
+  printf("%-8s %10s %12s %10s %10s %10s %10s\n", "", "requests", "req/s",
+          "p50 us", "p99 us", "p999 us", "max us");
+
+  for(int type = 0; type < Request_Count; type++) {
+    Samples samples = { 0 };
+
+    for(int i = 0; i < opt.num_threads; i++)
+      merge(&samples, &threads[i].samples[type]);
+
+    merge(&all, &samples);
+    report_line(request_names[type], &samples, seconds);
+    free(samples.ns);
+  }
+
+  for(int i = 0; i < opt.num_threads; i++)
+    errors += threads[i].errors;
+
+  report_line("total", &all, seconds);
+  printf("errors   %10llu\n", (unsigned long long) errors);
+  free(all.ns);
+}
+
+
+// "ping:70,call:20,remote:10"
+static void parse_mix(char *mix) {
+  memset(opt.weights, 0, sizeof(opt.weights));
+
+  for(char *item = strtok(mix, ","); item != NULL; item = strtok(NULL, ",")) {
+    char *colon = strchr(item, ':');
+    int type;
+
+    if(colon != NULL)
+      *colon = '\0';
+
+    for(type = 0; type < Request_Count; type++) {
+      if(strcmp(item, request_names[type]) == 0)
+        break;
+    }
+
+    if(type == Request_Count) {
+      fprintf(stderr, "unknown request type %s\n", item);
+      exit(EXIT_FAILURE);
+    }
+
+    opt.weights[type] = colon != NULL ? atoi(colon + 1) : 1;
+  }
+}
+
+
+// "conn:module" for a local connection, "conn:module:address:port" otherwise
+static void parse_setup_connection(char *arg) {
+  SetupConnection *c = &opt.setup[opt.num_setup];
+  char *fields[4];
+  int n = 0;
+
+  if(opt.num_setup == MAX_SETUP_CONNECTIONS) {
+    fprintf(stderr, "at most %d connections can be added\n",
+              MAX_SETUP_CONNECTIONS);
+    exit(EXIT_FAILURE);
+  }
+
+  for(char *f = strtok(arg, ":"); f != NULL && n < 4; f = strtok(NULL, ":"))
+    fields[n++] = f;
+
+  if(n != 2 && n != 4) {
+    fprintf(stderr, "invalid connection %s\n", arg);
+    exit(EXIT_FAILURE);
+  }
+
+  memset(c, 0, sizeof(*c));
+  c->conn_id = atoi(fields[0]);
+  c->to_sm = atoi(fields[1]);
+  c->local = n == 2;
+
+  if(n == 4) {
+    if(inet_pton(AF_INET, fields[2], &c->address) != 1) {
+      fprintf(stderr, "invalid address %s\n", fields[2]);
+      exit(EXIT_FAILURE);
+    }
+    c->port = atoi(fields[3]);
+  }
+
+  opt.num_setup++;
+}
+
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  -h host         server address (127.0.0.1)\n"
+    "  -p port         server port (1236)\n"
+    "  -c conns        client connections (16)\n"
+    "  -t threads      generator threads (1)\n"
+    "  -n depth        requests in flight per connection (1)\n"
+    "  -d seconds      duration (10)\n"
+    "  -R rate         total requests per second, closed-loop if unset\n"
+    "  -m mix          request mix, e.g. ping:70,call:20,remote:10 (ping)\n"
+    "  -M module       module id of calls and remote outputs (1)\n"
+    "  -E entrypoint   entrypoint of calls (3)\n"
+    "  -r conn         connection id of remote outputs (0)\n"
+    "  -s bytes        payload size of calls and remote outputs (16)\n"
+    "  -l ta -u uuid   load the TA as the module before starting, the binary\n"
+    "                  is not sent if the server has it installed\n"
+    "  -a conn:module[:address:port]\n"
+    "                  add a connection before starting, repeatable\n"
+    "  -S              print the stage latencies measured by the server\n",
+    prog);
+  exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv) {
+  static BenchThread threads[MAX_THREADS];
+  BenchConn *conns;
+  int c;
+
+  while((c = getopt(argc, argv, "h:p:c:t:n:d:R:m:M:E:r:s:l:u:a:S")) != -1) {
+    switch(c) {
+      case 'h': opt.host = optarg; break;
+      case 'p': opt.port = atoi(optarg); break;
+      case 'c': opt.num_conns = atoi(optarg); break;
+      case 't': opt.num_threads = atoi(optarg); break;
+      case 'n': opt.depth = atoi(optarg); break;
+      case 'd': opt.duration = atof(optarg); break;
+      case 'R': opt.rate = atof(optarg); break;
+      case 'm': parse_mix(optarg); break;
+      case 'M': opt.module_id = atoi(optarg); break;
+      case 'E': opt.entrypoint = atoi(optarg); break;
+      case 'r': opt.conn_id = atoi(optarg); break;
+      case 's': opt.payload_size = atoi(optarg); break;
+      case 'l': opt.ta_path = optarg; break;
+      case 'u': opt.ta_uuid = optarg; break;
+      case 'a': parse_setup_connection(optarg); break;
+      case 'S': opt.server_stats = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if(opt.num_conns < 1 || opt.depth < 1 || opt.duration <= 0 ||
+      opt.num_threads < 1 || opt.num_threads > MAX_THREADS ||
+      (opt.ta_path != NULL && opt.ta_uuid == NULL))
+    usage(argv[0]);
+
+  if(opt.weights[0] + opt.weights[1] + opt.weights[2] == 0) {
+    fprintf(stderr, "the request mix is empty\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(opt.num_threads > opt.num_conns)
+    opt.num_threads = opt.num_conns;
+
+  build_frames();
+  setup();
+  if(opt.server_stats)
+    server_stats(1);
+
+  conns = calloc(opt.num_conns, sizeof(BenchConn));
+  if(conns == NULL)
+    die("calloc");
+
+  for(int i = 0; i < opt.num_conns; i++) {
+    conns[i].fd = connect_server();
+    conns[i].sent = malloc(opt.depth * sizeof(uint64_t));
+    conns[i].types = malloc(opt.depth);
+    if(conns[i].sent == NULL || conns[i].types == NULL)
+      die("malloc");
+  }
+
+  // consecutive slices of the connections
+  for(int i = 0, first = 0; i < opt.num_threads; i++) {
+    int count = opt.num_conns / opt.num_threads +
+                  (i < opt.num_conns % opt.num_threads);
+
+    threads[i].conns = conns + first;
+    threads[i].num_conns = count;
+    threads[i].rng = 2463534242u + i;
+    first += count;
+  }
+
+  uint64_t start = now_ns();
+  end_time = start + (uint64_t) (opt.duration * 1e9);
+
+  for(int i = 0; i < opt.num_threads; i++) {
+    if(pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]) != 0)
+      die("pthread_create");
+  }
+
+  for(int i = 0; i < opt.num_threads; i++)
+    pthread_join(threads[i].thread, NULL);
+
+  report(threads, (now_ns() - start) / 1e9);
+  if(opt.server_stats)
+    server_stats(0);
+  return 0;
+}
@@ -1,26 +1,47 @@
 #include "command_handlers.h"
-#include<stdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "enclave_utils.h"
 #include "addr.h"
 #include "connection.h"
 #include "utils.h"
+#include "stats.h"
 
 #if USE_PERIODIC_EVENTS
   #include "periodic_event.h"
 #endif
 
-ResultMessage handler_load_sm(CommandMessage m) {
-  ResultMessage res = load_enclave(m->message->payload, m->message->size);
+ResultMessage handler_load_cached_sm(CommandMessage m) {
+  ResultMessage res = load_cached_enclave(m->message->payload, m->message->size);
   destroy_command_message(m);
   return res;
 }
 
+ResultMessage handler_query_sm(CommandMessage m) {
+  ResultMessage res = query_enclave(m->message->payload, m->message->size);
+  destroy_command_message(m);
+  return res;
+}
+
+// Optional last byte of an AddConnection payload, a connection is added when
+// it is absent
+#define CONNECTION_ADD     0
+#define CONNECTION_UPDATE  1
+#define CONNECTION_REMOVE  2
+
 ResultMessage handler_add_connection(CommandMessage m) {
   Connection connection;
+  int mode = CONNECTION_ADD;
+
+  // [conn id u16 - to sm u16 - local u8 - to port u16 - to address 4 bytes
+  //  - mode u8 (optional)]
+  if (m->message->size < 11) {
+    destroy_command_message(m);
+    return RESULT(ResultCode_IllegalPayload);
+  }
 
-  int size = m->message->size;
-  
   int j = 0;
   connection.conn_id = 0;
   for(int n = 1; n >= 0; --n){
@@ -51,10 +72,32 @@ ResultMessage handler_add_connection(CommandMessage m) {
     connection.to_address.u8[n-7] = m->message->payload[n];
   }
 
+  if (m->message->size > 11)
+    mode = m->message->payload[11] & 0xFF;
+
   destroy_command_message(m);
 
-  if (!connections_add(&connection))
-     return RESULT(ResultCode_InternalError);
+  switch (mode) {
+    case CONNECTION_ADD: {
+      int added = connections_add(&connection);
+
+      if (added < 0)
+         return RESULT(ResultCode_BadRequest);
+      if (!added)
+         return RESULT(ResultCode_InternalError);
+      break;
+    }
+    case CONNECTION_UPDATE:
+      if (!connections_update(&connection))
+         return RESULT(ResultCode_BadRequest);
+      break;
+    case CONNECTION_REMOVE:
+      if (!connections_remove(connection.conn_id))
+         return RESULT(ResultCode_BadRequest);
+      break;
+    default:
+      return RESULT(ResultCode_IllegalPayload);
+  }
 
   return RESULT(ResultCode_Ok);
 }
@@ -62,6 +105,13 @@ ResultMessage handler_add_connection(CommandMessage m) {
 ResultMessage handler_call_entrypoint(CommandMessage m) {
   
   ResultMessage res;
+
+  // [module id u16 - entrypoint u16 - data]
+  if (m->message->size < 4) {
+    destroy_command_message(m);
+    return RESULT(ResultCode_IllegalPayload);
+  }
+
   int j = 0;
   uint16_t module_id = 0 ;
   for(int n = 1; n >= 0; --n){
@@ -80,10 +130,18 @@ ResultMessage handler_call_entrypoint(CommandMessage m) {
 
   switch(index) {
     case Entrypoint_Attest:
-      res = handle_attest(m->message->payload, module_id);
+      // [nonce u16 - challenge]
+      if (data_len < 2 + 16)
+        res = RESULT(ResultCode_IllegalPayload);
+      else
+        res = handle_attest(m->message->payload, module_id);
       break;
     case Entrypoint_SetKey:
-      res = handle_set_key(m->message->payload, module_id);
+      // [associated data - cipher - tag]
+      if (data_len < 7 + 16 + 16)
+        res = RESULT(ResultCode_IllegalPayload);
+      else
+        res = handle_set_key(m->message->payload, module_id);
       break;
     default:
       res = handle_user_entrypoint(m->message->payload, data_len, module_id);
@@ -94,15 +152,81 @@ ResultMessage handler_call_entrypoint(CommandMessage m) {
   return res;
 }
 
+/*
+  Unpack a RemoteOutputBatch: [count u16] then count times
+  [module id u16 - conn id u16 - size u16 - cipher - tag]
+*/
+static ResultMessage remote_output_batch(CommandMessage m) {
+  unsigned char *p = m->message->payload;
+  uint32_t left = m->message->size;
+  ResultCode code = ResultCode_Ok;
+
+  if (left < 2) {
+    destroy_command_message(m);
+    return RESULT(ResultCode_IllegalPayload);
+  }
+
+  uint16_t count = (p[0] << 8) | p[1];
+  ModuleInput inputs[MAX_INPUT_BATCH];
+  unsigned int pending = 0;
+  uint16_t pending_sm = 0;
+  p += 2;
+  left -= 2;
+
+  // consecutive outputs to the same module are handled together
+  for (uint16_t i = 0; i < count; i++) {
+    if (left < 6) {
+      code = ResultCode_IllegalPayload;
+      break;
+    }
+
+    uint16_t sm_id = (p[0] << 8) | p[1];
+    conn_index conn_id = (p[2] << 8) | p[3];
+    uint32_t size = (p[4] << 8) | p[5];
+
+    if (left < 6 + size + 16) {
+      code = ResultCode_IllegalPayload;
+      break;
+    }
+
+    if (pending == MAX_INPUT_BATCH || (pending > 0 && sm_id != pending_sm)) {
+      reactive_handle_inputs(pending_sm, inputs, pending);
+      pending = 0;
+    }
+
+    inputs[pending].conn_id = conn_id;
+    inputs[pending].size = size;
+    inputs[pending].encrypt = p + 6;
+    inputs[pending].tag = p + 6 + size;
+    pending_sm = sm_id;
+    pending++;
+
+    p += 6 + size + 16;
+    left -= 6 + size + 16;
+  }
+
+  if (pending > 0)
+    reactive_handle_inputs(pending_sm, inputs, pending);
+
+  destroy_command_message(m);
+
+  return RESULT(code);
+}
+
 ResultMessage handler_remote_output(CommandMessage m) {
 
-  uint32_t size = m->message->size - (2 + 2 + 16); // module id + conn id + tag
+  if (m->code == CommandCode_RemoteOutputBatch)
+    return remote_output_batch(m);
+
+  // module id + conn id + tag
+  if (m->message->size < 2 + 2 + 16) {
+    destroy_command_message(m);
+    return RESULT(ResultCode_IllegalPayload);
+  }
+
+  uint32_t size = m->message->size - (2 + 2 + 16);
   conn_index conn_id;
   uint16_t sm_id;
-  unsigned char *encrypt;
-  encrypt = malloc(size);
-  unsigned char *tag;
-  tag = malloc(16);
   
   int j = 0;
   sm_id = 0;
@@ -119,13 +243,10 @@ ResultMessage handler_remote_output(CommandMessage m) {
     ++j;
   }	
 
-  memcpy(encrypt, m->message->payload + 4, size);
-  memcpy(tag, m->message->payload + 4 + size, 16);
-
-  reactive_handle_input(sm_id, conn_id, encrypt, size, tag);
+  // cipher and tag are read in place, the message is kept until then
+  reactive_handle_input(sm_id, conn_id, m->message->payload + 4, size,
+                          m->message->payload + 4 + size);
 
-  free(encrypt);
-  free(tag);
   destroy_command_message(m);
 
   return RESULT(ResultCode_Ok);
@@ -137,30 +258,54 @@ ResultMessage handler_ping(CommandMessage m) {
   return RESULT(ResultCode_Ok);
 }
 
+/*
+  Report the latency histograms of the event handling stages.
+  The payload is empty or [flags u8], bit 0 resets the histograms once read
+*/
+ResultMessage handler_stats(CommandMessage m) {
+  unsigned char buf[512];
+  int reset = m->message->size >= 1 && (m->message->payload[0] & 1);
+
+  destroy_command_message(m);
+
+  size_t size = stats_serialize(buf, sizeof(buf));
+  unsigned char *payload = malloc(size);
+
+  if (size == 0 || payload == NULL) {
+    free(payload);
+    return RESULT(ResultCode_InternalError);
+  }
+
+  memcpy(payload, buf, size);
+  if (reset)
+    stats_reset();
+
+  return RESULT_DATA(ResultCode_Ok, size, payload);
+}
+
 ResultMessage handler_register_entrypoint(CommandMessage m) {
 
 #if USE_PERIODIC_EVENTS
   PeriodicEvent event;
-  ParseState *state = create_parse_state(m->message->payload,
-                           m->message->size);
+  unsigned char *payload = m->message->payload;
 
-   // The payload format is [module entry frequency]
-  if (!parse_int(state, &event.module))
-     return RESULT(ResultCode_IllegalPayload);
-  if (!parse_int(state, &event.entry))
-     return RESULT(ResultCode_IllegalPayload);
-
-  uint32_t *freq;
-  if (!parse_raw_data(state, sizeof(uint32_t), (uint8_t **)&freq))
+  // The payload format is [module u16 - entry u16 - frequency u32]
+  if (m->message->size < 8) {
+    destroy_command_message(m);
     return RESULT(ResultCode_IllegalPayload);
+  }
 
-  event.frequency = REVERSE_INT32(*freq);
-  event.counter = 0;
+  event.module = (payload[0] << 8) | payload[1];
+  event.entry = (payload[2] << 8) | payload[3];
+  event.frequency = ((uint32_t) payload[4] << 24) | (payload[5] << 16) |
+                      (payload[6] << 8) | payload[7];
 
-  free_parse_state(state);
   destroy_command_message(m);
 
-  periodic_event_add(&event);
+  if (event.frequency == 0)
+    return RESULT(ResultCode_IllegalPayload);
+  if (!periodic_event_add(&event))
+    return RESULT(ResultCode_InternalError);
 #else
   destroy_command_message(m);
 #endif
@@ -14,8 +14,10 @@ typedef enum
 ResultMessage handler_add_connection(CommandMessage m);
 ResultMessage handler_call_entrypoint(CommandMessage m);
 ResultMessage handler_remote_output(CommandMessage m);
-ResultMessage handler_load_sm(CommandMessage m);
+ResultMessage handler_load_cached_sm(CommandMessage m);
+ResultMessage handler_query_sm(CommandMessage m);
 ResultMessage handler_ping(CommandMessage m);
+ResultMessage handler_stats(CommandMessage m);
 ResultMessage handler_register_entrypoint(CommandMessage m);
 
 #endif
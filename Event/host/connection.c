@@ -1,41 +1,116 @@
 #include "connection.h"
 
+#include <string.h>
+#include <pthread.h>
+
 #include "utils.h"
 
-typedef struct Node
+// conn_index is 16 bits: the routing table is a two-level array indexed by
+// the connection id, with pages allocated on first use
+#define PAGE_BITS 8
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define NUM_PAGES (65536 / PAGE_SIZE)
+
+typedef struct Page
 {
-    Connection connection;
-    struct Node* next;
-} Node;
+    uint32_t present[PAGE_SIZE / 32];
+    Connection connections[PAGE_SIZE];
+} Page;
+
+static Page* pages[NUM_PAGES];
+
+static pthread_rwlock_t connections_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-static Node* connections_head = NULL;
+static inline int is_present(Page* page, unsigned int slot)
+{
+    return page != NULL && (page->present[slot / 32] >> (slot % 32)) & 1;
+}
+
+static inline void set_present(Page* page, unsigned int slot, int present)
+{
+    if (present)
+        page->present[slot / 32] |= 1u << (slot % 32);
+    else
+        page->present[slot / 32] &= ~(1u << (slot % 32));
+}
 
 int connections_add(Connection* connection)
 {
-    Node* node = malloc_aligned(sizeof(Node));
+    unsigned int index = connection->conn_id >> PAGE_BITS;
+    unsigned int slot = connection->conn_id & (PAGE_SIZE - 1);
+    int ret = 1;
+
+    pthread_rwlock_wrlock(&connections_lock);
 
-    if (node == NULL)
-        return 0;
+    if (pages[index] == NULL) {
+        pages[index] = malloc_aligned(sizeof(Page));
+
+        if (pages[index] != NULL)
+            memset(pages[index], 0, sizeof(Page));
+    }
 
-    node->connection = *connection;
-    node->next = connections_head;
-    connections_head = node;
-    return 1;
+    if (pages[index] == NULL) {
+        ret = 0;
+    }
+    else if (is_present(pages[index], slot)) {
+        ret = -1;
+    }
+    else {
+        pages[index]->connections[slot] = *connection;
+        set_present(pages[index], slot, 1);
+    }
+
+    pthread_rwlock_unlock(&connections_lock);
+    return ret;
+}
+
+int connections_update(Connection* connection)
+{
+    unsigned int index = connection->conn_id >> PAGE_BITS;
+    unsigned int slot = connection->conn_id & (PAGE_SIZE - 1);
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&connections_lock);
+
+    if (is_present(pages[index], slot)) {
+        pages[index]->connections[slot] = *connection;
+        ret = 1;
+    }
+
+    pthread_rwlock_unlock(&connections_lock);
+    return ret;
 }
 
-Connection* connections_get(uint16_t conn_id)
+int connections_remove(uint16_t conn_id)
 {
-    Node* current = connections_head;
+    unsigned int index = conn_id >> PAGE_BITS;
+    unsigned int slot = conn_id & (PAGE_SIZE - 1);
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&connections_lock);
+
+    if (is_present(pages[index], slot)) {
+        set_present(pages[index], slot, 0);
+        ret = 1;
+    }
 
-    while (current != NULL) {
-        Connection* connection = &current->connection;
+    pthread_rwlock_unlock(&connections_lock);
+    return ret;
+}
+
+int connections_get(uint16_t conn_id, Connection* connection)
+{
+    unsigned int index = conn_id >> PAGE_BITS;
+    unsigned int slot = conn_id & (PAGE_SIZE - 1);
+    int ret = 0;
 
-        if (connection->conn_id == conn_id) {
-            return connection;
-        }
+    pthread_rwlock_rdlock(&connections_lock);
 
-        current = current->next;
+    if (is_present(pages[index], slot)) {
+        *connection = pages[index]->connections[slot];
+        ret = 1;
     }
 
-    return NULL;
+    pthread_rwlock_unlock(&connections_lock);
+    return ret;
 }
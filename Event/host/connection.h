@@ -19,10 +19,18 @@ typedef struct
 } Connection;
 
 // Copies connection so may be stack allocated.
+// Returns 1 on success, -1 if conn_id is already used, 0 if OOM.
 int connections_add(Connection* connection);
 
-// We keep ownership of the returned Connection. May return NULL.
-Connection* connections_get(uint16_t conn_id);
+// Replaces an existing connection. Returns 0 if conn_id is unknown.
+int connections_update(Connection* connection);
+
+// Returns 0 if conn_id is unknown.
+int connections_remove(uint16_t conn_id);
+
+// Copies the connection out, since it may be updated or removed
+// concurrently. Returns 0 if conn_id is unknown.
+int connections_get(uint16_t conn_id, Connection* connection);
 
 
 #endif
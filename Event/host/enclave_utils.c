@@ -7,6 +7,7 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <sys/types.h>  
 #include <sys/socket.h>  
@@ -20,59 +21,27 @@
 #include "command_handlers.h"
 #include "utils.h"
 #include "connection.h"
-#include "uuid.h"
+#include "local_events.h"
+#include "module.h"
+#include "outbound.h"
+#include "stats.h"
+#include "ta_commands.h"
+#include "ta_cache.h"
 
 uint16_t PORT = 1236;
 
-typedef struct
-{
-  TEEC_UUID uuid;
-	TEEC_Context ctx;
-	TEEC_Session sess;
-  TEEC_Operation op;
-} TA_CTX;
-
-typedef struct CTX_Node
-{
-    TA_CTX ta_ctx;
-    struct CTX_Node* next;
-} CTX_Node;
-
-static CTX_Node* ta_ctx_head = NULL;
-
-int ta_ctx_add(TA_CTX* ta_ctx)
-{
-    CTX_Node* node = malloc_aligned(sizeof(CTX_Node));
-
-    if (node == NULL)
-        return 0;
-
-    node->ta_ctx = *ta_ctx;
-    node->next = ta_ctx_head;
-    ta_ctx_head = node;
-    return 1;
-}
+#define MAX_SHORT_BUFFER_RETRIES 4
 
-TA_CTX* ta_ctx_get(TEEC_UUID uuid)
+// Outputs left by a TA in a ShmSet
+typedef struct
 {
-    CTX_Node* current = ta_ctx_head;
-
-    while (current != NULL) {
-        TA_CTX* ctx = &current->ta_ctx;
-
-        if ((ctx->uuid.timeLow == uuid.timeLow) &&
-            (ctx->uuid.timeMid == uuid.timeMid) &&
-            (ctx->uuid.timeHiAndVersion == uuid.timeHiAndVersion) &&
-            !memcmp(ctx->uuid.clockSeqAndNode, uuid.clockSeqAndNode, 8)) {
-
-            return ctx;
-        }
-
-        current = current->next;
-    }
+  uint32_t count;
+  int wide;               // TA_OUTPUT_WIDE layout
+  size_t conn_id_size;    // bytes written by the TA in each buffer
+  size_t data_size;
+  size_t tag_size;
+} Outputs;
 
-    return NULL;
-}
 //---------------------------------------------------------------------------------------
 void check_rc (TEEC_Result rc, const char *errmsg, uint32_t *orig) {
    if (rc != TEEC_SUCCESS) {
@@ -82,9 +51,8 @@ void check_rc (TEEC_Result rc, const char *errmsg, uint32_t *orig) {
    }
 }
 
-TEEC_UUID calculate_uuid (unsigned char* buf){
+static uint16_t calculate_uuid (unsigned char* buf, TEEC_UUID* out){
 
-  UUID uuid_struct;
   TEEC_UUID uuid;
 
   int j = 0;
@@ -93,7 +61,6 @@ TEEC_UUID calculate_uuid (unsigned char* buf){
     id = id + (( buf[m] & 0xFF ) << (8*j));
     ++j;
   }
-  uuid_struct.module_id = id;
 
   j = 0;
   int timelow = 0;
@@ -126,146 +93,399 @@ TEEC_UUID calculate_uuid (unsigned char* buf){
   for(int m = 10; m < 18; m++){
     uuid.clockSeqAndNode[m-10] = buf[m];
   }
-  uuid_struct.uuid =  uuid;
-  uuid_add(&uuid_struct);
-  return uuid;
+  *out = uuid;
+  return id;
 }
 
-ResultMessage load_enclave(unsigned char* buf, uint32_t size) {
-
-  TA_CTX ctx;
+// Opens the sessions to the TA, in the context shared by every module
+static ResultMessage open_enclave(uint16_t module_id, TEEC_UUID* uuid) {
   TEEC_Result rc;
   uint32_t err_origin;
 
-  ctx.uuid = calculate_uuid(buf);
-
-  char fname[255] = { 0 };
-	FILE *file = NULL;
-  char path[] = "/lib/optee_armtz";
-
-  snprintf(fname, PATH_MAX,
-		     "%s/%08x-%04x-%04x-%02x%02x%s%02x%02x%02x%02x%02x%02x.ta",
-         path,
-		     ctx.uuid.timeLow,
-		     ctx.uuid.timeMid,
-		     ctx.uuid.timeHiAndVersion,
-		     ctx.uuid.clockSeqAndNode[0],
-		     ctx.uuid.clockSeqAndNode[1],
-		     "-",
-		     ctx.uuid.clockSeqAndNode[2],
-		     ctx.uuid.clockSeqAndNode[3],
-		     ctx.uuid.clockSeqAndNode[4],
-		     ctx.uuid.clockSeqAndNode[5],
-		     ctx.uuid.clockSeqAndNode[6],
-		     ctx.uuid.clockSeqAndNode[7]);
-  
-  file = fopen(fname, "w"); 
-  
-  fwrite(buf + 18 ,1, size - 18 , file);
-  fclose(file); 
+  rc = modules_add(module_id, uuid, &err_origin);
+  if (rc == TEEC_ERROR_OUT_OF_MEMORY)
+    return RESULT(ResultCode_InternalError);
+  check_rc(rc, "TEEC_OpenSession", &err_origin);
 
-/* Initialize a context connecting us to the TEE */
-  rc = TEEC_InitializeContext(NULL, &ctx.ctx);
-  check_rc(rc, "TEEC_InitializeContext", NULL);
+  return RESULT(ResultCode_Ok);
+}
 
-// open a session to the TA
-  rc = TEEC_OpenSession(&ctx.ctx, &ctx.sess, &ctx.uuid, TEEC_LOGIN_PUBLIC, NULL, NULL, &err_origin);
-  check_rc(rc, "TEEC_OpenSession", &err_origin);
+// Starts receiving the TA binary of a LoadSM, header is
+// [module id u16 - uuid]. Returns NULL if it cannot be stored.
+TaUpload* load_enclave_begin(unsigned char* header) {
 
-//-----------------------------^^^^^^^^^&&&&&&&&^^^^^^^^^^----------
-  ta_ctx_add(&ctx);
+  TEEC_UUID uuid;
 
-//-----------------------------------------------------------------
-// everything went good
-  return RESULT(ResultCode_Ok);
+  calculate_uuid(header, &uuid);
+  return ta_upload_begin(&uuid);
+}
+
+// Installs the binary once the whole LoadSM payload of size bytes is
+// received and loads the module. upload is NULL if the payload is shorter
+// than the header, or if the binary could not be stored.
+ResultMessage load_enclave_end(unsigned char* header, TaUpload* upload,
+                                  uint32_t size) {
+
+  TEEC_UUID uuid;
+
+  if (size < LOAD_HEADER_SIZE)
+    return RESULT(ResultCode_IllegalPayload);
+
+  if (upload == NULL || !ta_upload_finish(upload))
+    return RESULT(ResultCode_InternalError);
+
+  uint16_t module_id = calculate_uuid(header, &uuid);
+  return open_enclave(module_id, &uuid);
+}
+
+// [module id u16 - uuid - SHA-256 of the binary]: loads a TA without its
+// binary if the same one is installed, BadRequest otherwise
+ResultMessage load_cached_enclave(unsigned char* buf, uint32_t size) {
+
+  TEEC_UUID uuid;
+
+  if (size != LOAD_HEADER_SIZE + SHA256_SIZE)
+    return RESULT(ResultCode_IllegalPayload);
+
+  uint16_t module_id = calculate_uuid(buf, &uuid);
+
+  if (!ta_cache_lookup(&uuid, buf + LOAD_HEADER_SIZE))
+    return RESULT(ResultCode_BadRequest);
+
+  return open_enclave(module_id, &uuid);
+}
+
+// Same payload as load_cached_enclave, the module id is not used. The
+// result payload is [1] if the binary is installed, [0] otherwise
+ResultMessage query_enclave(unsigned char* buf, uint32_t size) {
+
+  TEEC_UUID uuid;
+  unsigned char* present;
+
+  if (size != LOAD_HEADER_SIZE + SHA256_SIZE)
+    return RESULT(ResultCode_IllegalPayload);
+
+  calculate_uuid(buf, &uuid);
+
+  present = malloc_aligned(1);
+  if (present == NULL)
+    return RESULT(ResultCode_InternalError);
+
+  present[0] = ta_cache_lookup(&uuid, buf + LOAD_HEADER_SIZE);
+  return RESULT_DATA(ResultCode_Ok, 1, present);
+}
+
+// Points a parameter at a region of a pre-registered buffer
+static void set_memref(TEEC_Parameter* param, TEEC_SharedMemory* shm,
+                          size_t offset, size_t size) {
+  param->memref.parent = shm;
+  param->memref.offset = offset;
+  param->memref.size = size;
+}
+
+static size_t written(TEEC_Parameter* param, TEEC_SharedMemory* shm) {
+  return param->memref.size < shm->size ? param->memref.size : shm->size;
+}
+
+// Size of the inputs once laid out in the data buffer
+static size_t inputs_size(const ModuleInput* inputs, unsigned int count) {
+  size_t size = 0;
+
+  for (unsigned int i = 0; i < count; i++)
+    size += inputs[i].size;
+
+  return size;
+}
+
+// Copies the inputs in the shared buffers. A batch is laid out like wide
+// outputs: a [conn id u16 - len u16] entry per input, the data back to back
+// and the tags
+static void stage_inputs(ShmSet* shm, const ModuleInput* inputs,
+                          unsigned int count, int batch) {
+  unsigned char *entry = shm->conn_id.buffer;
+  unsigned char *data = shm->data.buffer;
+  unsigned char *tag = shm->tag.buffer;
+
+  for (unsigned int i = 0; i < count; i++) {
+    if (batch) {
+      entry[0] = inputs[i].conn_id >> 8;
+      entry[1] = inputs[i].conn_id & 0xFF;
+      entry[2] = inputs[i].size >> 8;
+      entry[3] = inputs[i].size & 0xFF;
+      entry += 4;
+    }
+
+    memcpy(data, inputs[i].encrypt, inputs[i].size);
+    data += inputs[i].size;
+
+    if (inputs[i].tag != NULL) {
+      memcpy(tag, inputs[i].tag, TA_TAG_SIZE);
+      tag += TA_TAG_SIZE;
+    }
+  }
+}
+
+/*
+  Invoke HANDLE_INPUT, HANDLE_INPUT_BATCH or ENTRYPOINT. The inputs are
+  copied in the shared buffers and the outputs are left there. If they do
+  not fit, the buffers are grown to the sizes asked by the TA and the call
+  is made again
+
+  @cmd: TA_CMD_HANDLE_INPUT, TA_CMD_HANDLE_INPUT_BATCH or TA_CMD_ENTRYPOINT
+  @value: conn id of the input, index of the entrypoint, or number of inputs
+          of a batch
+  @inputs: inputs, only a batch has more than one. The tag of an
+           entrypoint call is NULL
+  @out: set to the outputs on success
+
+  @return: result of the last TEEC_InvokeCommand
+*/
+static TEEC_Result invoke_with_outputs(Module* module, ShmSet* shm, uint32_t cmd,
+                          uint32_t value, const ModuleInput* inputs,
+                          unsigned int count, Outputs* out, uint32_t* err_origin) {
+  TEEC_Result rc = TEEC_ERROR_OUT_OF_MEMORY;
+  TEEC_Operation op;
+  int batch = cmd == TA_CMD_HANDLE_INPUT_BATCH;
+  int tagged = inputs[0].tag != NULL;
+  size_t size = inputs_size(inputs, count);
+
+  if (!module_shm_reserve(&shm->data, size) ||
+      (batch && !module_shm_reserve(&shm->conn_id, 4 * count)) ||
+      (tagged && !module_shm_reserve(&shm->tag, TA_TAG_SIZE * count)))
+    return rc;
+
+  for (int attempt = 0; attempt <= MAX_SHORT_BUFFER_RETRIES; attempt++) {
+    // the buffers are in/out, the inputs are copied again on a retry
+    stage_inputs(shm, inputs, count, batch);
+
+    memset(&op, 0, sizeof(op));
+    op.params[0].value.a = size;
+    op.params[0].value.b = value;
+    set_memref(&op.params[1], &shm->conn_id, 0, shm->conn_id.size);
+    set_memref(&op.params[2], &shm->data, 0, shm->data.size);
+    set_memref(&op.params[3], &shm->tag, 0, shm->tag.size);
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INOUT,
+                batch ? TEEC_MEMREF_PARTIAL_INOUT : TEEC_MEMREF_PARTIAL_OUTPUT,
+                TEEC_MEMREF_PARTIAL_INOUT,
+                tagged ? TEEC_MEMREF_PARTIAL_INOUT : TEEC_MEMREF_PARTIAL_OUTPUT);
+
+    ModuleSession* session = module_session_acquire(module);
+    if (session == NULL)
+      return TEEC_ERROR_OUT_OF_MEMORY;
+
+    uint64_t start = stats_now();
+    rc = TEEC_InvokeCommand(&session->sess, cmd, &op, err_origin);
+    stats_record(Stage_Invoke, start);
+    // outputs may be routed back to this same module, give the session back first
+    module_session_release(module, session);
+
+    if (rc != TEEC_ERROR_SHORT_BUFFER)
+      break;
+
+    if (!module_shm_reserve(&shm->conn_id, op.params[1].memref.size) ||
+        !module_shm_reserve(&shm->data, op.params[2].memref.size) ||
+        !module_shm_reserve(&shm->tag, op.params[3].memref.size))
+      return TEEC_ERROR_OUT_OF_MEMORY;
+  }
+
+  if (rc == TEEC_SUCCESS) {
+    out->count = op.params[0].value.b;
+    out->wide = batch || (op.params[0].value.a & TA_OUTPUT_WIDE) != 0;
+    out->conn_id_size = written(&op.params[1], &shm->conn_id);
+    out->data_size = written(&op.params[2], &shm->data);
+    out->tag_size = written(&op.params[3], &shm->tag);
+  }
+
+  return rc;
+}
+
+// Routes the outputs left by the TA in the shared buffers. The buffers are
+// read in place, the output handlers copy what they keep
+static void route_outputs(ShmSet* shm, Outputs* out) {
+  unsigned char *conn_id_buf = shm->conn_id.buffer;
+  unsigned char *encrypt_buf = shm->data.buffer;
+  unsigned char *tag_buf = shm->tag.buffer;
+  size_t entry_size = out->wide ? 4 : 2;
+  size_t index = 0;
+  uint32_t i;
+
+  for(i = 0; i < out->count; i++) {
+    uint64_t start = stats_now();
+    unsigned char *entry = conn_id_buf + entry_size * i;
+    size_t data_len;
+
+    // never trust the TA to stay within the buffers
+    if(entry_size * (i + 1) > out->conn_id_size ||
+        (size_t) TA_TAG_SIZE * (i + 1) > out->tag_size)
+      break;
+
+    uint16_t conn_id = (entry[0] << 8) | entry[1];
+
+    if(out->wide) {
+      data_len = (entry[2] << 8) | entry[3];
+    }
+    else {
+      if(index + 1 > out->data_size)
+        break;
+      data_len = encrypt_buf[index++];
+    }
+
+    if(index + data_len > out->data_size)
+      break;
+
+    // the routing of the output is timed by its own stages
+    stats_record(Stage_Demux, start);
+    reactive_handle_output(conn_id, encrypt_buf + index, data_len,
+                              tag_buf + (TA_TAG_SIZE * i));
+
+    index += data_len;
+  }
+
+  if(i < out->count)
+    printf("outputs overflow the TA buffers, %u dropped\n", out->count - i);
+}
+
+/*
+  Give a key to a module on a session already acquired
+
+  @key: KEY_DATA_SIZE bytes, [ad - cipher - tag] as in a SetKey payload
+
+  @return: result of the invocation
+*/
+static TEEC_Result invoke_set_key(Module* ta_ctx, ModuleSession* session,
+                    const unsigned char* key, uint32_t* err_origin) {
+
+  ShmSet* shm = module_shm_acquire(ta_ctx);
+  if (shm == NULL)
+    return TEEC_ERROR_OUT_OF_MEMORY;
+
+  // ad and cipher share the data buffer
+  unsigned char* data = shm->data.buffer;
+  memcpy(data, key, 7);
+  memcpy(data + 16, key + 7, 16);
+  memcpy(shm->tag.buffer, key + 23, 16);
+
+  TEEC_Operation op;
+
+  memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INPUT,
+					 TEEC_MEMREF_PARTIAL_INPUT,
+					 TEEC_MEMREF_PARTIAL_INPUT, TEEC_NONE);
+  set_memref(&op.params[0], &shm->data, 0, 7);
+  set_memref(&op.params[1], &shm->data, 16, 16);
+  set_memref(&op.params[2], &shm->tag, 0, 16);
+
+  uint64_t start = stats_now();
+  TEEC_Result rc = TEEC_InvokeCommand(&session->sess, TA_CMD_SET_KEY, &op, err_origin);
+  stats_record(Stage_Invoke, start);
+  module_shm_release(ta_ctx, shm);
+
+  return rc;
+}
+
+void restore_module_keys(Module* module, ModuleSession* session) {
+  uint32_t err_origin;
+  unsigned int count = 0;
+
+  // keys are only added with a session in use, none is while restoring
+  for(ModuleKey* key = module->keys; key != NULL; key = key->next) {
+    TEEC_Result rc = invoke_set_key(module, session, key->data, &err_origin);
+
+    if(rc != TEEC_SUCCESS)
+      printf("module %u: key not restored: 0x%x\n", module->module_id, rc);
+    else
+      count++;
+  }
+
+  printf("module %u reopened, %u keys restored\n", module->module_id, count);
+}
+
+TEEC_Result set_module_key(Module* ta_ctx, const unsigned char* key,
+                    uint32_t* err_origin) {
+
+  *err_origin = TEEC_ORIGIN_API;
+
+  ModuleSession* session = module_session_acquire(ta_ctx);
+  if (session == NULL)
+    return TEEC_ERROR_OUT_OF_MEMORY;
+
+  TEEC_Result rc = invoke_set_key(ta_ctx, session, key, err_origin);
+
+  // kept while the session is in use, so that a restore cannot miss it
+  if (rc == TEEC_SUCCESS && !module_keep_key(ta_ctx, key, KEY_DATA_SIZE))
+    rc = TEEC_ERROR_OUT_OF_MEMORY;
+  module_session_release(ta_ctx, session);
+
+  return rc;
 }
 
 ResultMessage handle_set_key(unsigned char* buf, uint16_t module_id) {
 
-  UUID* uuid_struct = uuid_get(module_id);
+  uint64_t start = stats_now();
+  Module* ta_ctx = modules_get(module_id);
+  stats_record(Stage_Lookup, start);
   TEEC_Result rc;
   uint32_t err_origin;
-  unsigned char* ad;
-  unsigned char* cipher;
-  unsigned char* tag;
-//----------------------------------------------------------------------------------
-  
-  ad = malloc(7);
-  memcpy(ad, buf+4, 7);
-  cipher = malloc(16);
-  memcpy(cipher, buf+11, 16);
-  tag = malloc(16);
-  memcpy(tag, buf+27, 16);
-
-//-----------------------------^^^^^^^^^&&&&&&&&^^^^^^^^^^------------------------
-  TA_CTX* ta_ctx = ta_ctx_get(uuid_struct->uuid);
-//-----------------------------------------------------------------
-  memset(&ta_ctx->op, 0, sizeof(ta_ctx->op));
-	ta_ctx->op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-					 TEEC_MEMREF_TEMP_INPUT,
-					 TEEC_MEMREF_TEMP_INPUT, TEEC_NONE);
-	ta_ctx->op.params[0].tmpref.buffer = ad;
-	ta_ctx->op.params[0].tmpref.size = 7;
-	ta_ctx->op.params[1].tmpref.buffer = cipher;
-	ta_ctx->op.params[1].tmpref.size = 16;
-	ta_ctx->op.params[2].tmpref.buffer = tag;
-	ta_ctx->op.params[2].tmpref.size = 16;
-
-  TEEC_Session temp_sess;
-  TEEC_Context temp_ctx;
-  temp_ctx.fd = ta_ctx->ctx.fd;
-  temp_ctx.reg_mem = ta_ctx->ctx.reg_mem;
-  temp_ctx.memref_null = ta_ctx->ctx.memref_null;
-
-  temp_sess.session_id = ta_ctx->sess.session_id;
-  temp_sess.ctx = &temp_ctx;
-
-  rc = TEEC_InvokeCommand(&temp_sess, 0, &ta_ctx->op, &err_origin);
+
+  if (ta_ctx == NULL)
+    return RESULT(ResultCode_BadRequest);
+
+  rc = set_module_key(ta_ctx, buf + 4, &err_origin);
+  if (rc == TEEC_ERROR_OUT_OF_MEMORY)
+    return RESULT(ResultCode_InternalError);
   check_rc(rc, "TEEC_InvokeCommand", &err_origin);
 
 // everything went good
-  ResultMessage res = RESULT(ResultCode_Ok);
-  free(ad);
-  free(cipher);
-  free(tag);
-  return res;
+  return RESULT(ResultCode_Ok);
 }
 
 ResultMessage handle_attest(unsigned char* buf, uint16_t module_id) {
 
-  UUID* uuid_struct = uuid_get(module_id);
+  uint64_t start = stats_now();
+  Module* ta_ctx = modules_get(module_id);
+  stats_record(Stage_Lookup, start);
   TEEC_Result rc;
   uint32_t err_origin;
-  unsigned char* challenge;
-  unsigned char* challenge_mac;
+
+  if (ta_ctx == NULL)
+    return RESULT(ResultCode_BadRequest);
+
+  // the result owns its payload, the mac is copied out of the shared buffer
+  unsigned char* challenge_mac = malloc(16);
+  if (challenge_mac == NULL)
+    return RESULT(ResultCode_InternalError);
+
+  ShmSet* shm = module_shm_acquire(ta_ctx);
+  if (shm == NULL) {
+    free(challenge_mac);
+    return RESULT(ResultCode_InternalError);
+  }
 //----------------------------------------------------------------------------------
-  
-  challenge = malloc(16);
-  memcpy(challenge, buf+6, 16);
-  challenge_mac = malloc(16);
-
-//-----------------------------^^^^^^^^^&&&&&&&&^^^^^^^^^^-------------------------
-  TA_CTX* ta_ctx = ta_ctx_get(uuid_struct->uuid);
-//-----------------------------------------------------------------
-  memset(&ta_ctx->op, 0, sizeof(ta_ctx->op));
-	ta_ctx->op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-					 TEEC_MEMREF_TEMP_OUTPUT,
+
+  memcpy(shm->data.buffer, buf+6, 16);
+
+  TEEC_Operation op;
+  ModuleSession* session = module_session_acquire(ta_ctx);
+  if (session == NULL) {
+    module_shm_release(ta_ctx, shm);
+    free(challenge_mac);
+    return RESULT(ResultCode_InternalError);
+  }
+
+  memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INPUT,
+					 TEEC_MEMREF_PARTIAL_OUTPUT,
 					 TEEC_NONE, TEEC_NONE);
-	ta_ctx->op.params[0].tmpref.buffer = challenge;
-	ta_ctx->op.params[0].tmpref.size = 16;
-	ta_ctx->op.params[1].tmpref.buffer = challenge_mac;
-	ta_ctx->op.params[1].tmpref.size = 16;
-
-  TEEC_Session temp_sess;
-  TEEC_Context temp_ctx;
-  temp_ctx.fd = ta_ctx->ctx.fd;
-  temp_ctx.reg_mem = ta_ctx->ctx.reg_mem;
-  temp_ctx.memref_null = ta_ctx->ctx.memref_null;
-  
-  temp_sess.session_id = ta_ctx->sess.session_id;
-  temp_sess.ctx = &temp_ctx;
+  set_memref(&op.params[0], &shm->data, 0, 16);
+  set_memref(&op.params[1], &shm->tag, 0, 16);
+
 
-  rc = TEEC_InvokeCommand(&temp_sess, 1, &ta_ctx->op, &err_origin);
+  start = stats_now();
+  rc = TEEC_InvokeCommand(&session->sess, TA_CMD_ATTEST, &op, &err_origin);
+  stats_record(Stage_Invoke, start);
+  module_session_release(ta_ctx, session);
+  memcpy(challenge_mac, shm->tag.buffer, 16);
+  module_shm_release(ta_ctx, shm);
   check_rc(rc, "TEEC_InvokeCommand", &err_origin);
  
 // everything went good
@@ -276,10 +496,15 @@ ResultMessage handle_attest(unsigned char* buf, uint16_t module_id) {
 
 ResultMessage handle_user_entrypoint(unsigned char* buf, uint32_t size, uint16_t module_id) {
 
-  UUID* uuid_struct = uuid_get(module_id);
+  uint64_t start = stats_now();
+  Module* ctx1 = modules_get(module_id);
+  stats_record(Stage_Lookup, start);
   TEEC_Result rc;
   uint32_t err_origin;
 
+  if (ctx1 == NULL)
+    return RESULT(ResultCode_BadRequest);
+
   //----------------------------------------------------------------------------------
   int j = 0;
   uint32_t index = 0;
@@ -287,75 +512,28 @@ ResultMessage handle_user_entrypoint(unsigned char* buf, uint32_t size, uint16_t
     index = index + (( buf[m] & 0xFF ) << (8*j));
     ++j;
   }
-  //-----------------^^^^^^^^^&&&&&&&&^^^^^^^^^^---------------------
-  TA_CTX* ctx1 = ta_ctx_get(uuid_struct->uuid);
-  //-----------------------------------------------------------------
-  unsigned char *conn_id_buf;
-  conn_id_buf = malloc(32);
-  unsigned char *encrypt_buf;
-  encrypt_buf = malloc(16 * 16);
-  memcpy(encrypt_buf, buf + 4, size);
-  unsigned char *tag_buf;
-  tag_buf = malloc(256);
-
-  memset(&ctx1->op, 0, sizeof(ctx1->op));
-  ctx1->op.params[0].value.b = index; // the number of output
-  ctx1->op.params[0].value.a = size; // size of data
-  ctx1->op.params[1].tmpref.buffer = (void *) conn_id_buf;
-  ctx1->op.params[1].tmpref.size = 32; // 16 * 2
-  ctx1->op.params[2].tmpref.buffer = (void *) encrypt_buf;
-  ctx1->op.params[2].tmpref.size = 16 * 16; // 16 * 16
-  ctx1->op.params[3].tmpref.buffer = (void *) tag_buf;
-  ctx1->op.params[3].tmpref.size = 256; // 16 * 16
-  ctx1->op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INOUT, TEEC_MEMREF_TEMP_OUTPUT,
-                TEEC_MEMREF_TEMP_INOUT, TEEC_MEMREF_TEMP_OUTPUT);
-
-
-  TEEC_Session temp_sess1;
-  TEEC_Context temp_ctx1;
-  temp_ctx1.fd = ctx1->ctx.fd;
-  temp_ctx1.reg_mem = ctx1->ctx.reg_mem;
-  temp_ctx1.memref_null = ctx1->ctx.memref_null;
-  
-  temp_sess1.session_id = ctx1->sess.session_id;
-  temp_sess1.ctx = &temp_ctx1;
 
-  rc = TEEC_InvokeCommand(&temp_sess1, 3, &ctx1->op, &err_origin);
+  // held until the outputs are routed, they are read in place
+  ShmSet* shm = module_shm_acquire(ctx1);
+  if (shm == NULL)
+    return RESULT(ResultCode_InternalError);
+
+  ModuleInput input = { 0, size, buf + 4, NULL };
+  Outputs out;
+  rc = invoke_with_outputs(ctx1, shm, TA_CMD_ENTRYPOINT, index, &input, 1,
+                              &out, &err_origin);
+  if (rc == TEEC_ERROR_OUT_OF_MEMORY) {
+    module_shm_release(ctx1, shm);
+    return RESULT(ResultCode_InternalError);
+  }
   check_rc(rc, "TEEC_InvokeCommand", &err_origin);
 
-  if (rc == TEEC_SUCCESS) {
-    int index = 0;
-    for(int i = 0; i < ctx1->op.params[0].value.b; i++) {
-
-      uint16_t conn_id = 0;
-      unsigned char *handle_encrypt;
-      unsigned char *handle_tag;
-      int data_len = 0;
-      data_len = encrypt_buf[index] & 0xFF;
-      
-      handle_encrypt = malloc(data_len);
-      handle_tag = malloc(16);
-      int j = 0;
-      for(int m = (2 * i) + 1; m >= (2*i); --m){
-        conn_id = conn_id + (( conn_id_buf[m] & 0xFF ) << (8*j));
-        ++j;
-      }
-      memcpy(handle_encrypt, encrypt_buf + index + 1, data_len);
-      memcpy(handle_tag, tag_buf + (16 * i), 16);
-
-      reactive_handle_output(conn_id, handle_encrypt, data_len, handle_tag);
-
-      index =  index + data_len + 1;
-      free(handle_encrypt);
-      free(handle_tag);
-    }
-  }
+  if (rc == TEEC_SUCCESS)
+    route_outputs(shm, &out);
+
+  module_shm_release(ctx1, shm);
   // *************************************************
-  ResultMessage res = RESULT(ResultCode_Ok);
-  free(conn_id_buf);
-  free(encrypt_buf);
-  free(tag_buf);
-  return res;
+  return RESULT(ResultCode_Ok);
 }
 
 static int is_local_connection(Connection* connection) {
@@ -365,160 +543,142 @@ static int is_local_connection(Connection* connection) {
 
 static void handle_local_connection(Connection* connection,
                           unsigned char *encrypt, uint32_t size, unsigned char *tag) {
-    reactive_handle_input(connection->to_sm, connection->conn_id, encrypt, size, tag);
+    // queued rather than handled here: a chain of local connections would
+    // otherwise recurse once per hop, holding a set of shared buffers each
+    local_events_push(connection->to_sm, connection->conn_id, encrypt, size, tag);
 }
 
 static void handle_remote_connection(Connection* connection,
                             unsigned char *encrypt, uint32_t size, unsigned char *tag) {
-    unsigned char payload[23 + size];
-
-    //----------------------------------------------------------
-    int sockfd; 
-    struct sockaddr_in servaddr; 
-
-    char loopback[16] = "127.0.0.1";
-    char ip[16] = {0};
 
-    sprintf(ip, "%d.%d.%d.%d", connection->to_address.u8[0], connection->to_address.u8[1], 
-                connection->to_address.u8[2],connection->to_address.u8[3]);
-
-    if(strcmp(ip, loopback) == 0){
-        sprintf(ip, "%d.%d.%d.%d", 10, 0, 2, 2); //10.0.2.2 --> QEMU gateway IP address
-    }
-	// socket create and varification 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0); 
-    if (sockfd == -1) { 
-        printf("socket creation failed...\n"); 
-        exit(0); 
-    } 
-    else
-        printf("Socket successfully created..\n"); 
-                    
-    bzero(&servaddr, sizeof(servaddr)); 
-  
-    servaddr.sin_family = AF_INET; 
-    servaddr.sin_addr.s_addr = inet_addr(ip);
-    servaddr.sin_port = htons(connection->to_port); 
-  
-    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0) { 
-        printf("connection with the server failed...\n"); 
-		    perror("connect");
-        exit(0); 
-    } 
-    else
-        printf("connected to the server..\n"); 
-
-    //---------------------------------------------------------------------
-    uint16_t conn_id = htons(connection->conn_id);
-    uint16_t to_sm   = htons(connection->to_sm);
-
-    bzero(payload, 23 + size);
-    payload[0] = command_code_to_u8(CommandCode_RemoteOutput);
-    uint16_t htons_size = htons(2 + 2 + size + 16); // module id + conn id + cipher + tag
-    memcpy(payload + 1, &htons_size, 2);
-    memcpy(payload + 3, &to_sm, 2);
-    memcpy(payload + 5, &conn_id, 2);
-    memcpy(payload + 7, encrypt, size);
-    memcpy(payload + 7 + size, tag, 16);
-   
-    // and send that buffer to client 
-    write(sockfd, payload, sizeof(payload));
-    bzero(payload, sizeof(payload)); 
-    int ret = read(sockfd, payload, sizeof(payload));
-    ResultCode code = u8_to_result_code(payload[0]);
-    if(code == ResultCode_Ok){
-      close(sockfd);
+    Outbound *peer = outbound_get(&connection->to_address, connection->to_port);
+    if (peer == NULL) {
+        printf("no memory for connection to the server...\n");
+        return;
     }
+
+    // coalesced with the other outputs to the same peer, the ack is
+    // matched asynchronously
+    outbound_send_output(peer, connection->to_sm, connection->conn_id,
+                          encrypt, size, tag);
 }
 
 void reactive_handle_output(uint16_t conn_id, unsigned char* encrypt, uint32_t size, unsigned char *tag)
 {
-  Connection* connection = connections_get(conn_id);
+  Connection connection;
+  uint64_t start = stats_now();
+  int found = connections_get(conn_id, &connection);
+
+  stats_record(Stage_Lookup, start);
+  if (!found) {
+      printf("output on unknown connection %d dropped\n", conn_id);
+      return;
+  }
 
-  if (is_local_connection(connection))
-      handle_local_connection(connection, encrypt, size, tag);
+  if (is_local_connection(&connection))
+      handle_local_connection(&connection, encrypt, size, tag);
   else
-      handle_remote_connection(connection, encrypt, size, tag);
+      handle_remote_connection(&connection, encrypt, size, tag);
+}
+
+// Handles the inputs of a module one invocation each
+static void handle_inputs(Module* module, const ModuleInput* inputs,
+                          unsigned int count) {
+  TEEC_Result rc;
+  uint32_t err_origin;
+
+  for (unsigned int i = 0; i < count; i++) {
+    ShmSet* shm = module_shm_acquire(module);
+    if (shm == NULL) {
+      printf("no shared memory for module %d, input dropped\n", module->module_id);
+      continue;
+    }
+
+    Outputs out;
+    rc = invoke_with_outputs(module, shm, TA_CMD_HANDLE_INPUT, inputs[i].conn_id,
+                                &inputs[i], 1, &out, &err_origin);
+    if (rc == TEEC_ERROR_OUT_OF_MEMORY) {
+      printf("no shared memory for module %d, input dropped\n", module->module_id);
+      module_shm_release(module, shm);
+      continue;
+    }
+    check_rc(rc, "TEEC_InvokeCommand", &err_origin);
+
+    if (rc == TEEC_SUCCESS)
+      route_outputs(shm, &out);
+
+    module_shm_release(module, shm);
+  }
 }
 
-void reactive_handle_input(uint16_t sm, conn_index conn_id, 
+// A TA without HANDLE_INPUT_BATCH rejects it as an unknown command. Bad
+// parameters are an error like for any other invocation, not a reason to
+// stop batching
+static int batch_rejected(TEEC_Result rc, uint32_t err_origin) {
+  return err_origin == TEEC_ORIGIN_TRUSTED_APP &&
+          (rc == TEEC_ERROR_NOT_SUPPORTED || rc == TEEC_ERROR_NOT_IMPLEMENTED);
+}
+
+void reactive_handle_input(uint16_t sm, conn_index conn_id,
                           unsigned char *encrypt, uint32_t size, unsigned char *tag) {
+  ModuleInput input = { conn_id, size, encrypt, tag };
 
-  struct timeval start, stop, tval_result;
+  reactive_handle_inputs(sm, &input, 1);
+}
 
-	gettimeofday(&start, NULL);
-	printf("Time elapsed in EM: %ld.%06ld\n", (long int)start.tv_sec, 
-							(long int)start.tv_usec);
-  
+/*
+  Handle several inputs of the same module. They are passed to the TA in a
+  single HANDLE_INPUT_BATCH invocation, saving a world switch per input.
+  Modules whose TA does not implement it get one HANDLE_INPUT per input
+
+  @sm: module
+  @inputs: inputs, in the order the module should see them
+  @count: number of inputs
+*/
+void reactive_handle_inputs(uint16_t sm, const ModuleInput* inputs,
+                          unsigned int count) {
   TEEC_Result rc;
-  uint32_t err_origin;
-  UUID* uuid_struct = uuid_get(sm);
-  //-----------------------------------------------------------------
-  TA_CTX* ta_ctx = ta_ctx_get(uuid_struct->uuid);
-  //-----------------------------------------------------------------
-  unsigned char *conn_id_buf;
-  conn_id_buf = malloc(32);
-  unsigned char *encrypt_buf;
-  encrypt_buf = malloc(16 * 16);
-  memcpy(encrypt_buf, encrypt, size);
-  unsigned char *tag_buf;
-  tag_buf = malloc(256);
-  memcpy(tag_buf, tag, 16);
-
-  memset(&ta_ctx->op, 0, sizeof(ta_ctx->op));
-	ta_ctx->op.params[0].value.a = size;
-  ta_ctx->op.params[0].value.b = conn_id;
-	ta_ctx->op.params[1].tmpref.buffer = (void *) conn_id_buf;
-	ta_ctx->op.params[1].tmpref.size = 32;
-	ta_ctx->op.params[2].tmpref.buffer = (void *) encrypt_buf;
-	ta_ctx->op.params[2].tmpref.size = 16 * 16;
-  ta_ctx->op.params[3].tmpref.buffer = (void *) tag_buf;
-	ta_ctx->op.params[3].tmpref.size = 16 * 16;
-  ta_ctx->op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INOUT, TEEC_MEMREF_TEMP_OUTPUT,
-					        TEEC_MEMREF_TEMP_INOUT, TEEC_MEMREF_TEMP_INOUT);
-
-  TEEC_Session temp_sess;
-  TEEC_Context temp_ctx;
-  temp_ctx.fd = ta_ctx->ctx.fd;
-  temp_ctx.reg_mem = ta_ctx->ctx.reg_mem;
-  temp_ctx.memref_null = ta_ctx->ctx.memref_null;
- 
-  temp_sess.session_id = ta_ctx->sess.session_id;
-  temp_sess.ctx = &temp_ctx;
+  uint32_t err_origin = 0;
+  uint64_t start = stats_now();
+  Module* ta_ctx = modules_get(sm);
+  stats_record(Stage_Lookup, start);
+
+  if (ta_ctx == NULL) {
+    printf("input to unknown module %d dropped\n", sm);
+    return;
+  }
+
+  if (count == 1 || __atomic_load_n(&ta_ctx->no_batch, __ATOMIC_RELAXED)) {
+    handle_inputs(ta_ctx, inputs, count);
+    return;
+  }
+
+  ShmSet* shm = module_shm_acquire(ta_ctx);
+  if (shm == NULL) {
+    printf("no shared memory for module %d, input dropped\n", sm);
+    return;
+  }
 
-  rc = TEEC_InvokeCommand(&temp_sess, 2, &ta_ctx->op, &err_origin);
+  Outputs out;
+  rc = invoke_with_outputs(ta_ctx, shm, TA_CMD_HANDLE_INPUT_BATCH, count, inputs,
+                              count, &out, &err_origin);
+
+  // the TA has not handled any of the inputs, they can be passed again
+  if (rc == TEEC_ERROR_OUT_OF_MEMORY || batch_rejected(rc, err_origin)) {
+    module_shm_release(ta_ctx, shm);
+
+    if (rc != TEEC_ERROR_OUT_OF_MEMORY) {
+      printf("module %d does not handle batches of inputs\n", sm);
+      __atomic_store_n(&ta_ctx->no_batch, 1, __ATOMIC_RELAXED);
+    }
+
+    handle_inputs(ta_ctx, inputs, count);
+    return;
+  }
   check_rc(rc, "TEEC_InvokeCommand", &err_origin);
 
-  if (rc == TEEC_SUCCESS) {
-    int index = 0;
-    for(int i = 0; i < ta_ctx->op.params[0].value.b; i++) {
-      uint16_t conn_id = 0;
-      unsigned char *handle_encrypt;
-      unsigned char *handle_tag;
-      int data_len = 0;
-      data_len = encrypt_buf[index] & 0xFF;
-      
-      handle_encrypt = malloc(data_len);
-      handle_tag = malloc(16);
-      int j = 0;
-      for(int m = (2 * i) + 1; m >= (2*i); --m){
-        conn_id = conn_id + (( conn_id_buf[m] & 0xFF ) << (8*j));
-        ++j;
-      }
-      memcpy(handle_encrypt, encrypt_buf + index + 1, data_len);
-      memcpy(handle_tag, tag_buf + (16 * i), 16);
-
-      reactive_handle_output(conn_id, handle_encrypt, data_len, handle_tag);
-
-      index =  index + data_len + 1;
-      free(handle_encrypt);
-      free(handle_tag);
-    } // for
-  } // if success
-  // *************************************************
- 
-  free(conn_id_buf);
-  free(encrypt_buf);
-  free(tag_buf);
+  if (rc == TEEC_SUCCESS)
+    route_outputs(shm, &out);
 
+  module_shm_release(ta_ctx, shm);
 }
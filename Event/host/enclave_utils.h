@@ -3,15 +3,55 @@
 
 #include <stdint.h>
 
+#include "module.h"
 #include "networking.h"
+#include "ta_cache.h"
 
 typedef uint16_t io_index;
 typedef uint16_t conn_index;
 
-ResultMessage load_enclave(unsigned char* buf, uint32_t size);
+// Inputs grouped for one invocation of a module at most
+#define MAX_INPUT_BATCH 64
+
+// Input of a module, read in place
+typedef struct
+{
+  conn_index conn_id;
+  uint32_t size;
+  unsigned char *encrypt;
+  unsigned char *tag;
+} ModuleInput;
+
+// LoadSM is not buffered: its [module id u16 - uuid] header is followed by
+// the TA binary, written to a file as it is received
+#define LOAD_HEADER_SIZE 18
+
+TaUpload* load_enclave_begin(unsigned char* header);
+ResultMessage load_enclave_end(unsigned char* header, TaUpload* upload,
+                                  uint32_t size);
+ResultMessage load_cached_enclave(unsigned char* buf, uint32_t size);
+ResultMessage query_enclave(unsigned char* buf, uint32_t size);
+
+// SetKey data after its entrypoint header: [ad 7 - cipher 16 - tag 16]
+#define KEY_DATA_SIZE (7 + 16 + 16)
+
+// Gives a key to a module without exiting on a TEE error, unlike
+// handle_set_key. The key is replayed if the module is evicted
+TEEC_Result set_module_key(Module* ta_ctx, const unsigned char* key,
+                    uint32_t* err_origin);
+
+ResultMessage handle_set_key(unsigned char* buf, uint16_t module_id);
+ResultMessage handle_attest(unsigned char* buf, uint16_t module_id);
+ResultMessage handle_user_entrypoint(unsigned char* buf, uint32_t size, uint16_t module_id);
+
+// ModuleRestore of the modules: gives them the keys they accepted again
+void restore_module_keys(Module* module, ModuleSession* session);
 
 void reactive_handle_output(conn_index conn_id, unsigned char *encrypt, uint32_t size, unsigned char *tag);
-//void reactive_handle_input(sm_id sm, conn_index conn_id, void* data, size_t len);
+void reactive_handle_input(uint16_t sm, conn_index conn_id,
+                          unsigned char *encrypt, uint32_t size, unsigned char *tag);
+void reactive_handle_inputs(uint16_t sm, const ModuleInput *inputs,
+                          unsigned int count);
 
 
 #endif
@@ -0,0 +1,484 @@
+#define _GNU_SOURCE
+#include "event_loop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "event_manager.h"
+#include "utils.h"
+
+#define INITIAL_WATCHES 64
+
+// Loop run by the calling thread, so that deep code (e.g. outbound
+// connections) can register its own fds
+static __thread EventLoop *current_loop = NULL;
+
+
+/*
+  Put a file descriptor in non-blocking mode
+
+  @fd: file descriptor
+
+  @return: 0 on success, -1 on error
+*/
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+
+  if(flags < 0)
+    return -1;
+
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+/*
+  Make sure the watch table can be indexed by fd, doubling it if needed
+
+  @return: 1 on success, 0 on OOM
+*/
+static int watches_reserve(EventLoop *loop, int fd) {
+  size_t cap = loop->watches_cap;
+
+  if((size_t) fd < cap)
+    return 1;
+
+  while(cap <= (size_t) fd)
+    cap *= 2;
+
+  Watch *watches = realloc(loop->watches, cap * sizeof(Watch));
+  if(watches == NULL)
+    return 0;
+
+  memset(watches + loop->watches_cap, 0,
+            (cap - loop->watches_cap) * sizeof(Watch));
+  loop->watches = watches;
+  loop->watches_cap = cap;
+  return 1;
+}
+
+
+/*
+  Register a file descriptor with the loop. The handler is called with the
+  ready events, in edge-triggered mode
+
+  @loop: event loop
+  @fd: file descriptor, should be non-blocking
+  @events: EPOLLIN, EPOLLOUT, ... (EPOLLET is added)
+  @handler: callback
+  @arg: passed to the callback
+
+  @return: 1 on success, 0 on error
+*/
+int event_loop_watch(EventLoop *loop, int fd, uint32_t events,
+                      EventHandler handler, void *arg) {
+  struct epoll_event ev;
+
+  if(!watches_reserve(loop, fd))
+    return 0;
+
+  ev.events = events | EPOLLET;
+  ev.data.fd = fd;
+  if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("epoll_ctl");
+    return 0;
+  }
+
+  loop->watches[fd].handler = handler;
+  loop->watches[fd].arg = arg;
+  return 1;
+}
+
+
+// Must be called before closing a watched fd
+void event_loop_unwatch(EventLoop *loop, int fd) {
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  loop->watches[fd].handler = NULL;
+  loop->watches[fd].arg = NULL;
+}
+
+
+static int deferred_push(DeferredList *list, void (*fn)(void *arg), void *arg) {
+  if(list->len == list->cap) {
+    size_t cap = list->cap == 0 ? 16 : list->cap * 2;
+    Deferred *items = realloc(list->items, cap * sizeof(Deferred));
+
+    if(items == NULL)
+      return 0;
+
+    list->items = items;
+    list->cap = cap;
+  }
+
+  list->items[list->len].fn = fn;
+  list->items[list->len].arg = arg;
+  list->len++;
+  return 1;
+}
+
+
+/*
+  Run fn(arg) once the events of the current iteration have been handled,
+  before waiting for new ones. Used to coalesce work produced by several
+  events (e.g. outputs to the same peer)
+
+  @return: 1 on success, 0 on OOM
+*/
+int event_loop_defer(EventLoop *loop, void (*fn)(void *arg), void *arg) {
+  return deferred_push(&loop->deferred, fn, arg);
+}
+
+
+/*
+  Run fn(arg) in the next iteration, after the sockets have been polled
+  without blocking. Used for internal work that must not starve network
+  input (e.g. a long chain of local deliveries)
+
+  @return: 1 on success, 0 on OOM
+*/
+int event_loop_post(EventLoop *loop, void (*fn)(void *arg), void *arg) {
+  return deferred_push(&loop->posted, fn, arg);
+}
+
+
+// Callbacks may defer more work, it runs in the same pass
+static void run_deferred(EventLoop *loop) {
+  for(size_t i = 0; i < loop->deferred.len; i++)
+    loop->deferred.items[i].fn(loop->deferred.items[i].arg);
+
+  loop->deferred.len = 0;
+}
+
+
+// Work posted by the callbacks is left for the next iteration
+static void run_posted(EventLoop *loop) {
+  size_t count = loop->posted.len;
+
+  for(size_t i = 0; i < count; i++)
+    loop->posted.items[i].fn(loop->posted.items[i].arg);
+
+  memmove(loop->posted.items, loop->posted.items + count,
+            (loop->posted.len - count) * sizeof(Deferred));
+  loop->posted.len -= count;
+}
+
+
+/*
+  Have fn(call) run by the loop. Safe to call from any thread, the calls
+  are run in order after the loop is woken up
+
+  @loop: event loop
+  @call: callback, owned by the caller until it runs
+*/
+void event_loop_call(EventLoop *loop, LoopCall *call) {
+  uint64_t one = 1;
+
+  call->next = NULL;
+
+  pthread_mutex_lock(&loop->calls_lock);
+  if(loop->calls_tail == NULL)
+    loop->calls_head = call;
+  else
+    loop->calls_tail->next = call;
+  loop->calls_tail = call;
+  pthread_mutex_unlock(&loop->calls_lock);
+
+  // the counter only overflows after 2^64 - 1 pending wakeups
+  if(write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("eventfd");
+}
+
+
+static void run_calls(void *arg, uint32_t events) {
+  EventLoop *loop = arg;
+  uint64_t count;
+  LoopCall *call;
+
+  (void) events;
+
+  if(read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("eventfd");
+
+  pthread_mutex_lock(&loop->calls_lock);
+  call = loop->calls_head;
+  loop->calls_head = NULL;
+  loop->calls_tail = NULL;
+  pthread_mutex_unlock(&loop->calls_lock);
+
+  while(call != NULL) {
+    LoopCall *next = call->next;
+
+    call->fn(call);
+    call = next;
+  }
+}
+
+
+EventLoop *event_loop_current(void) {
+  return current_loop;
+}
+
+
+static void client_event(void *arg, uint32_t events);
+
+static void client_add(EventLoop *loop, int fd) {
+  Client *client = malloc_aligned(sizeof(Client));
+
+  if(client == NULL) {
+    fprintf(stderr, "Out of memory, dropping socket %d\n", fd);
+    close(fd);
+    return;
+  }
+
+  client->fd = fd;
+  if(!frame_decoder_init(&client->decoder)) {
+    fprintf(stderr, "Out of memory, dropping socket %d\n", fd);
+    free(client);
+    close(fd);
+    return;
+  }
+  result_writer_init(&client->writer);
+  client->throttled = 0;
+  client->loads = 0;
+  client->closed = 0;
+
+  // EPOLLOUT is edge-triggered too, it only fires once a full socket
+  // buffer has room again
+  if(!event_loop_watch(loop, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP,
+                          client_event, client)) {
+    frame_decoder_destroy(&client->decoder);
+    free(client);
+    close(fd);
+    return;
+  }
+
+  loop->num_clients++;
+}
+
+
+static void client_free(Client *client) {
+  result_writer_destroy(&client->writer);
+  free(client);
+}
+
+
+// A client with loads running is kept until they are done, their responses
+// go to its writer
+static void client_remove(EventLoop *loop, Client *client) {
+  event_loop_unwatch(loop, client->fd);
+  close(client->fd);
+  client->fd = -1;
+  loop->num_clients--;
+  frame_decoder_destroy(&client->decoder);
+
+  if(client->loads > 0)
+    client->closed = 1;
+  else
+    client_free(client);
+}
+
+
+/*
+  Accept every pending connection on the (edge-triggered) listener
+*/
+static void accept_clients(void *arg, uint32_t events) {
+  EventLoop *loop = arg;
+  (void) events;
+
+  while(1) {
+    int fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if(fd < 0) {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept");
+      return;
+    }
+
+    client_add(loop, fd);
+  }
+}
+
+
+// The socket is edge-triggered: event_manager_run() drains it, keeping any
+// partial frame in the client decoder for the next wakeup
+static int handle_client(EventLoop *loop, Client *client) {
+  int ret = event_manager_run(client);
+
+  if(ret < 0) {
+    client_remove(loop, client);
+    return 0;
+  }
+
+  client->throttled = ret;
+  return 1;
+}
+
+
+// The socket has room again: send the queued responses, and resume reading
+// if the input was left in the socket because of them
+static int handle_writable(EventLoop *loop, Client *client) {
+  int ret = result_writer_flush(&client->writer, client->fd);
+
+  if(ret < 0) {
+    client_remove(loop, client);
+    return 0;
+  }
+
+  if(ret == 1 && client->throttled)
+    return handle_client(loop, client);
+
+  return 1;
+}
+
+
+/*
+  A load of the client is done, its response can be sent. Reading resumes
+  if it was waiting for the load
+*/
+void event_loop_client_resume(Client *client) {
+  EventLoop *loop = current_loop;
+
+  if(client->closed) {
+    if(client->loads == 0)
+      client_free(client);
+    return;
+  }
+
+  if(client->throttled) {
+    handle_client(loop, client);
+    return;
+  }
+
+  if(result_writer_flush(&client->writer, client->fd) < 0)
+    client_remove(loop, client);
+}
+
+
+static void client_event(void *arg, uint32_t events) {
+  Client *client = arg;
+  EventLoop *loop = current_loop;
+
+  if(events & (EPOLLERR | EPOLLHUP)) {
+    client_remove(loop, client);
+    return;
+  }
+
+  if((events & EPOLLOUT) && !handle_writable(loop, client))
+    return;
+
+  // EPOLLRDHUP is handled by event_manager_run reading EOF
+  if((events & (EPOLLIN | EPOLLRDHUP)) && !client->throttled)
+    handle_client(loop, client);
+}
+
+
+/*
+  Initialize an event loop serving connections accepted on listen_fd
+
+  @loop: loop to initialize
+  @listen_fd: socket already bound and listening
+
+  @return: 0 on success, -1 on error
+*/
+int event_loop_init(EventLoop *loop, int listen_fd) {
+  memset(loop, 0, sizeof(*loop));
+  loop->listen_fd = listen_fd;
+  loop->wake_fd = -1;
+  pthread_mutex_init(&loop->calls_lock, NULL);
+
+  if(set_nonblocking(listen_fd) < 0) {
+    perror("fcntl");
+    return -1;
+  }
+
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if(loop->epoll_fd < 0) {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  loop->watches = calloc(INITIAL_WATCHES, sizeof(Watch));
+  if(loop->watches == NULL) {
+    close(loop->epoll_fd);
+    return -1;
+  }
+  loop->watches_cap = INITIAL_WATCHES;
+
+  if(!event_loop_watch(loop, listen_fd, EPOLLIN, accept_clients, loop)) {
+    event_loop_destroy(loop);
+    return -1;
+  }
+
+  loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(loop->wake_fd < 0 ||
+      !event_loop_watch(loop, loop->wake_fd, EPOLLIN, run_calls, loop)) {
+    perror("eventfd");
+    event_loop_destroy(loop);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+  Run the loop forever. Each wakeup only touches the fds that are ready
+*/
+void event_loop_run(EventLoop *loop) {
+  struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+  current_loop = loop;
+
+  while(1) {
+    // only poll when internal work is waiting
+    int timeout = loop->posted.len > 0 ? 0 : -1;
+    int n = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+
+    if(n < 0) {
+      if(errno != EINTR)
+        perror("epoll_wait");
+      continue;
+    }
+
+    for(int i = 0; i < n; i++) {
+      Watch *watch = &loop->watches[events[i].data.fd];
+
+      // the fd may have been unwatched by an earlier handler
+      if(watch->handler != NULL)
+        watch->handler(watch->arg, events[i].events);
+    }
+
+    run_posted(loop);
+    run_deferred(loop);
+  }
+}
+
+
+void event_loop_destroy(EventLoop *loop) {
+  current_loop = loop;
+
+  for(size_t fd = 0; fd < loop->watches_cap; fd++) {
+    if(loop->watches[fd].handler == client_event)
+      client_remove(loop, loop->watches[fd].arg);
+  }
+
+  free(loop->watches);
+  loop->watches = NULL;
+  free(loop->deferred.items);
+  loop->deferred.items = NULL;
+  free(loop->posted.items);
+  loop->posted.items = NULL;
+  if(loop->wake_fd >= 0)
+    close(loop->wake_fd);
+  close(loop->epoll_fd);
+}
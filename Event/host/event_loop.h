@@ -0,0 +1,67 @@
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "event_manager.h"
+
+#define EVENT_LOOP_MAX_EVENTS 256
+
+// Called with the epoll events of a watched fd
+typedef void (*EventHandler)(void *arg, uint32_t events);
+
+typedef struct watch {
+  EventHandler handler;
+  void *arg;
+} Watch;
+
+// One-shot callback run once the ready events of an iteration are handled
+typedef struct deferred {
+  void (*fn)(void *arg);
+  void *arg;
+} Deferred;
+
+typedef struct deferred_list {
+  Deferred *items;
+  size_t len;
+  size_t cap;
+} DeferredList;
+
+// Callback handed to a loop by another thread, embedded in the caller's
+// own structure so that it cannot fail
+typedef struct loop_call {
+  void (*fn)(struct loop_call *call);
+  struct loop_call *next;
+} LoopCall;
+
+typedef struct event_loop {
+  int epoll_fd;
+  int listen_fd;
+  Watch *watches;       // indexed by fd, grown on demand
+  size_t watches_cap;
+  size_t num_clients;
+  DeferredList deferred;  // run at the end of the current iteration
+  DeferredList posted;    // run in the next one, after polling the sockets
+  int wake_fd;            // eventfd signalled when calls are queued
+  pthread_mutex_t calls_lock;
+  LoopCall *calls_head;   // queued by other threads
+  LoopCall *calls_tail;
+} EventLoop;
+
+int event_loop_init(EventLoop *loop, int listen_fd);
+void event_loop_run(EventLoop *loop);
+void event_loop_destroy(EventLoop *loop);
+
+EventLoop *event_loop_current(void);
+int event_loop_watch(EventLoop *loop, int fd, uint32_t events,
+                      EventHandler handler, void *arg);
+void event_loop_unwatch(EventLoop *loop, int fd);
+int event_loop_defer(EventLoop *loop, void (*fn)(void *arg), void *arg);
+int event_loop_post(EventLoop *loop, void (*fn)(void *arg), void *arg);
+void event_loop_call(EventLoop *loop, LoopCall *call);
+
+void event_loop_client_resume(Client *client);
+
+#endif
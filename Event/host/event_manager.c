@@ -1,15 +1,25 @@
 #include <stdio.h> 
 #include <netdb.h> 
 #include <netinet/in.h> 
+#include <arpa/inet.h> 
 #include <stdlib.h> 
 #include <string.h> 
 #include <sys/socket.h> 
 #include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
 
+#include "event_manager.h"
 #include "networking.h"
 #include "command_handlers.h"
+#include "ring_buffer.h"
+#include "stats.h"
+#include "event_loop.h"
+#include "loader.h"
+#include "utils.h"
 
-#define MAX 200000
+#define RX_RING_SIZE  16384
+#define MAX_PENDING_RESULTS 1024
 
 
 ResultMessage process_message(CommandMessage m) {
@@ -21,108 +31,329 @@ ResultMessage process_message(CommandMessage m) {
       return handler_call_entrypoint(m); // third "set-key" and // fourth call // attest
 
     case CommandCode_RemoteOutput:
+    case CommandCode_RemoteOutputBatch:
       return handler_remote_output(m); // 
 
-    case CommandCode_LoadSM:
-      return handler_load_sm(m); // firsttttt
-
     case CommandCode_Ping:
       return handler_ping(m);
 
     case CommandCode_RegisterEntrypoint:
       return handler_register_entrypoint(m);
 
+    case CommandCode_Stats:
+      return handler_stats(m);
+
+    case CommandCode_QuerySM:
+      return handler_query_sm(m);
+
+    case CommandCode_LoadCachedSM:
+      return handler_load_cached_sm(m);
+
     default: // CommandCode_Invalid
+      destroy_command_message(m);
       return NULL;
   }
 }
 
-// Function designed for reading data on the socket 
-int event_manager_run(int sd, struct sockaddr_in address, int addrlen,
-           int *client_socket, int index) {
-
-    unsigned char buff[MAX]; 
-    unsigned char data[MAX];
-    unsigned char *payload;
-    int n = 0; 
-    int ret = 1;
-    int size = 0;
-    int byte_to_read = 6;
- 
-    bzero(buff, MAX);
-    bzero(data, MAX);
-
-    //Check if it was for closing , and also read the incoming message   
-    while((n < byte_to_read)){
-      
-      ret = read(sd, buff, sizeof(buff));
-    	if(ret == 0) {
-        //Somebody disconnected , get his details and print  
-        //getpeername(sd , (struct sockaddr*)&address ,(socklen_t*)&addrlen);   
-        //printf("Host disconnected , ip %s , port %d \n", 
-                  //inet_ntoa(address.sin_addr) , ntohs(address.sin_port));   
-                         
-        //Close the socket and mark as 0 in list for reuse 
-        close(sd);  
-        client_socket[index] = 0;
-        return 0;
+// Prepare the decoder for the next frame
+static void frame_decoder_clear(FrameDecoder *d) {
+  d->state = Decoder_Code;
+  d->code = CommandCode_Invalid;
+  d->length_size = 2;
+  d->length_read = 0;
+  d->size = 0;
+  d->payload = NULL;
+  d->payload_read = 0;
+  d->upload = NULL;
+}
+
+/*
+  Initialize the decoder of a new socket
+
+  @return: 1 on success, 0 on OOM
+*/
+int frame_decoder_init(FrameDecoder *d) {
+  frame_decoder_clear(d);
+  return ring_buffer_init(&d->rx, RX_RING_SIZE);
+}
+
+// Drops a partially received frame and the receive buffer
+void frame_decoder_destroy(FrameDecoder *d) {
+  free(d->payload);
+  if(d->upload != NULL)
+    ta_upload_abort(d->upload);
+  ring_buffer_destroy(&d->rx);
+}
+
+
+/*
+  Move the bytes buffered in the receive ring into the frame being decoded.
+  The TA binary of a LoadSM goes straight from the ring to its file, so
+  that its size does not matter
+
+  @return: 1 if a frame is complete, 2 if a LoadSM is, 0 if the ring ran out
+           of data, -1 if OOM
+*/
+static int frame_decoder_next(FrameDecoder *d) {
+  RingBuffer *rx = &d->rx;
+
+  while(1) {
+    switch(d->state) {
+      case Decoder_Code: {
+        unsigned char code;
+
+        if(ring_buffer_pop(rx, &code, 1) == 0)
+          return 0;
+
+        d->code = u8_to_command_code(code);
+        // LoadSM carries a whole TA binary, so its length is 32 bits
+        d->length_size = d->code == CommandCode_LoadSM ? 4 : 2;
+        d->length_read = 0;
+        d->state = Decoder_Length;
+        break;
       }
-      if (ret > 0){
-    	  memcpy(data + n, buff, ret);
-    	  n = n + ret;
-    	  size = 0;
-        //==========================================================
-        CommandCode code = u8_to_command_code(data[0]);
-        if(code == 3) {
-          if(n > 5) {
-    		    int j = 0;
-    		    for(int m= 4; m>=1; --m) {
-    			    size = size + (( data[m] & 0xFF ) << (8*j));
-    			    ++j;
-    		    }		
-    	    }
-    	    byte_to_read = 1 + 4 + size;
+
+      case Decoder_Length:
+        d->length_read += ring_buffer_pop(rx, d->length + d->length_read,
+                                   d->length_size - d->length_read);
+        if(d->length_read < d->length_size)
+          return 0;
+
+        d->size = 0;
+        for(uint32_t i = 0; i < d->length_size; i++)
+          d->size = (d->size << 8) | d->length[i];
+
+        d->payload_read = 0;
+        if(d->code == CommandCode_LoadSM) {
+          d->state = Decoder_Upload;
+          break;
+        }
+
+        if(d->size > 0 && (d->payload = malloc(d->size)) == NULL)
+          return -1;
+
+        d->payload_read = 0;
+        d->state = Decoder_Payload;
+        break;
+
+      case Decoder_Payload:
+        d->payload_read += ring_buffer_pop(rx, d->payload + d->payload_read,
+                                   d->size - d->payload_read);
+        return d->payload_read == d->size;
+
+      case Decoder_Upload: {
+        uint32_t header = d->size < LOAD_HEADER_SIZE ? d->size : LOAD_HEADER_SIZE;
+
+        if(d->payload_read < header) {
+          d->payload_read += ring_buffer_pop(rx, d->header + d->payload_read,
+                                     header - d->payload_read);
+          if(d->payload_read < header)
+            return 0;
+
+          if(header == LOAD_HEADER_SIZE)
+            d->upload = load_enclave_begin(d->header);
         }
-        else {
-          if(n > 3) {
-    		    int j = 0;
-    		    for(int m = 2; m>=1; --m) {
-    			    size = size + (( data[m] & 0xFF ) << (8*j));
-    			    ++j;
-    		    }		
-    	    }
-    	    byte_to_read = 1 + 2 + size;
+
+        // without an upload the binary is read and dropped
+        while(d->payload_read < d->size) {
+          unsigned char *data;
+          size_t n = ring_buffer_peek(rx, &data);
+
+          if(n == 0)
+            return 0;
+          if(n > d->size - d->payload_read)
+            n = d->size - d->payload_read;
+
+          if(d->upload != NULL)
+            ta_upload_write(d->upload, data, n);
+          ring_buffer_consume(rx, n);
+          d->payload_read += n;
         }
-        //=----------------------------------------------------------------
-      } // ret > 0
-    }// while loop
-    
-    payload = malloc(size);
-    CommandCode code = u8_to_command_code(data[0]);
-    if(code == 3){
-      memcpy(payload, data+5, size);
+
+        return 2;
+      }
+    }
+  }
+}
+
+
+static void load_done(LoopCall *call) {
+  LoadJob *job = (LoadJob *) call;
+  Client *client = job->arg;
+
+  result_writer_fill(&client->writer, job->slot, job->result);
+  client->loads--;
+  free(job);
+
+  event_loop_client_resume(client);
+}
+
+
+/*
+  Hand a load to the loader pool. Its response keeps its place among the
+  responses of the client
+
+  @return: 1 on success, 0 on OOM (the upload is dropped)
+*/
+static int load_submit(Client *client, CommandCode code, unsigned char *payload,
+                          size_t len, uint32_t size, TaUpload *upload) {
+  LoadJob *job = malloc_aligned(sizeof(LoadJob));
+
+  if(job == NULL || !result_writer_reserve(&client->writer, &job->slot)) {
+    free(job);
+    if(upload != NULL)
+      ta_upload_abort(upload);
+    return 0;
+  }
+
+  job->call.fn = load_done;
+  job->loop = event_loop_current();
+  job->code = code;
+  memcpy(job->payload, payload, len);
+  job->size = size;
+  job->upload = upload;
+  job->result = NULL;
+  job->arg = client;
+
+  client->loads++;
+  loader_submit(job);
+  return 1;
+}
+
+
+// A command may depend on a module loaded before it, it waits for the loads
+// of the client. Loads themselves are run in parallel
+static int load_barrier(Client *client) {
+  FrameDecoder *d = &client->decoder;
+  unsigned char *next;
+
+  if(client->loads == 0 || d->state != Decoder_Code ||
+      ring_buffer_peek(&d->rx, &next) == 0)
+    return 0;
+
+  CommandCode code = u8_to_command_code(*next);
+  return code != CommandCode_LoadSM && code != CommandCode_LoadCachedSM;
+}
+
+
+/*
+  Handle the frames complete in the receive ring, in order
+
+  @return: 0 once the ring has no complete frame, 1 if a frame waits for a
+           load, -1 if OOM
+*/
+static int dispatch_frames(Client *client) {
+  FrameDecoder *decoder = &client->decoder;
+  ResultWriter *writer = &client->writer;
+  uint64_t start = stats_now();
+  int complete;
+
+  while(1) {
+    if(load_barrier(client))
+      return 1;
+
+    complete = frame_decoder_next(decoder);
+    if(complete <= 0)
+      return complete;
+
+    // the TA binary of a LoadSM is received, install it in the background
+    if(complete == 2) {
+      TaUpload *upload = decoder->upload;
+      uint32_t size = decoder->size;
+
+      // the upload belongs to the job now
+      frame_decoder_clear(decoder);
+
+      if(upload == NULL)
+        result_writer_push(writer, load_enclave_end(decoder->header, NULL, size));
+      else if(!load_submit(client, CommandCode_LoadSM, decoder->header,
+                              LOAD_HEADER_SIZE, size, upload))
+        result_writer_push(writer, RESULT(ResultCode_InternalError));
+
+      start = stats_now();
+      continue;
+    }
+
+    Message msg = create_message(decoder->size, decoder->payload);
+    CommandMessage m = create_command_message(decoder->code, msg);
+
+    stats_record(Stage_Decode, start);
+
+    // the message owns the payload now
+    frame_decoder_clear(decoder);
+
+    if(m->code == CommandCode_LoadCachedSM &&
+        msg->size == LOAD_HEADER_SIZE + SHA256_SIZE) {
+      if(!load_submit(client, m->code, msg->payload, msg->size, msg->size, NULL))
+        result_writer_push(writer, RESULT(ResultCode_InternalError));
+      destroy_command_message(m);
     }
     else {
-      memcpy(payload, data+3, size);
+      ResultMessage res = process_message(m);
+
+      if(res != NULL)
+        result_writer_push(writer, res);
     }
-    Message msg = create_message(size, payload);
-    CommandMessage m = create_command_message(code, msg);
-    ResultMessage res = process_message(m);
-
-    if(res != NULL) {
-      bzero(buff, MAX);
-      buff[0] = result_code_to_u8(res->code);
-      Message msg = res->message;
-      uint16_t response_size = msg->size;
-      uint16_t htons_size = htons(response_size);
-      memcpy(buff+1, &htons_size, 2);
-      memcpy(buff+3, msg->payload, msg->size);
-      // and send that buffer to client 
-      write(sd, buff, sizeof(buff));
-      destroy_result_message(res);
+
+    start = stats_now();
+  }
+}
+
+
+// Function designed for reading data on the socket. Every read fills the
+// receive ring, and all the frames it completes are dispatched in order.
+// Their responses are queued on the writer and flushed together.
+// Never blocks waiting for the rest of a frame or for the peer to read.
+// Returns -1 when the peer went away and the socket must be dropped, 1 when
+// reading stopped because too many responses are waiting to be sent or
+// because a command waits for a load
+int event_manager_run(Client *client) {
+  ResultWriter *writer = &client->writer;
+  int sd = client->fd;
+  int drained = 0;
+  int ret = 0;
+
+  while(1) {
+    // frames left in the ring by a previous run come first
+    int dispatched = dispatch_frames(client);
+
+    if(dispatched != 0) {
+      ret = dispatched;
+      break;
     }
 
-    return 0;
+    // if the peer is not reading its responses, leave its input in the
+    // socket until they drain
+    if(result_writer_pending(writer) >= MAX_PENDING_RESULTS) {
+      int flushed = result_writer_flush(writer, sd);
 
-   
-}
\ No newline at end of file
+      if(flushed != 1)
+        return flushed < 0 ? -1 : 1;
+      continue;
+    }
+
+    // a short read means the socket is drained
+    if(drained)
+      break;
+
+    size_t space = ring_buffer_space(&client->decoder.rx);
+    ssize_t n = ring_buffer_recv(&client->decoder.rx, sd);
+
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if(n <= 0) {
+      //Somebody disconnected, the event loop closes the socket
+      ret = -1;
+      break;
+    }
+
+    drained = (size_t) n < space;
+  }
+
+  if(result_writer_flush(writer, sd) < 0)
+    ret = -1;
+
+  return ret;
+}
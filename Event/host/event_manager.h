@@ -1,8 +1,50 @@
 #ifndef __EVENT_MANAGER_H__
 #define __EVENT_MANAGER_H__
 
+#include <stdint.h>
 
-int event_manager_run(int sd, struct sockaddr_in address, int addrlen, 
-                        int *client_socket, int index);
+#include "networking.h"
+#include "ring_buffer.h"
+#include "result_writer.h"
+#include "enclave_utils.h"
+
+typedef enum {
+  Decoder_Code,
+  Decoder_Length,
+  Decoder_Payload,
+  Decoder_Upload        // LoadSM payload, streamed to a file
+} DecoderState;
+
+// Per-socket state of the frame being received. Keeps partial header and
+// payload bytes between two readiness events, bytes read past the current
+// frame wait in the receive ring
+typedef struct frame_decoder {
+  RingBuffer rx;
+  DecoderState state;
+  CommandCode code;
+  unsigned char length[4];
+  uint32_t length_size;   // 4 for LoadSM, 2 for every other command
+  uint32_t length_read;
+  uint32_t size;
+  unsigned char *payload;
+  uint32_t payload_read;
+  unsigned char header[LOAD_HEADER_SIZE];
+  TaUpload *upload;
+} FrameDecoder;
+
+int frame_decoder_init(FrameDecoder *d);
+void frame_decoder_destroy(FrameDecoder *d);
+
+// State kept for every accepted socket
+typedef struct client {
+  int fd;
+  FrameDecoder decoder;
+  ResultWriter writer;
+  int throttled;        // input left unread until the responses drain
+  unsigned int loads;   // modules being loaded for this socket
+  int closed;           // socket gone, freed once the loads are done
+} Client;
+
+int event_manager_run(Client *client);
 
 #endif
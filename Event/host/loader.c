@@ -0,0 +1,84 @@
+#include "loader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static LoadJob *jobs_head;
+static LoadJob *jobs_tail;
+
+
+static LoadJob *loader_next(void) {
+  LoadJob *job;
+
+  pthread_mutex_lock(&jobs_lock);
+
+  while(jobs_head == NULL)
+    pthread_cond_wait(&jobs_cond, &jobs_lock);
+
+  job = jobs_head;
+  jobs_head = job->next;
+  if(jobs_head == NULL)
+    jobs_tail = NULL;
+
+  pthread_mutex_unlock(&jobs_lock);
+  return job;
+}
+
+
+// Every loader opens the sessions of one module at a time, independent
+// modules are loaded in parallel
+static void *loader_main(void *arg) {
+  (void) arg;
+
+  while(1) {
+    LoadJob *job = loader_next();
+
+    if(job->code == CommandCode_LoadSM)
+      job->result = load_enclave_end(job->payload, job->upload, job->size);
+    else
+      job->result = load_cached_enclave(job->payload, job->size);
+
+    event_loop_call(job->loop, &job->call);
+  }
+
+  return NULL;
+}
+
+
+/*
+  Start the loader threads
+
+  @threads: number of modules loaded in parallel
+
+  @return: 1 on success, 0 on error
+*/
+int loader_init(unsigned int threads) {
+  pthread_t thread;
+
+  for(unsigned int i = 0; i < threads; i++) {
+    if(pthread_create(&thread, NULL, loader_main, NULL) != 0) {
+      perror("pthread_create");
+      return 0;
+    }
+    pthread_detach(thread);
+  }
+
+  return 1;
+}
+
+
+void loader_submit(LoadJob *job) {
+  job->next = NULL;
+
+  pthread_mutex_lock(&jobs_lock);
+  if(jobs_tail == NULL)
+    jobs_head = job;
+  else
+    jobs_tail->next = job;
+  jobs_tail = job;
+  pthread_cond_signal(&jobs_cond);
+  pthread_mutex_unlock(&jobs_lock);
+}
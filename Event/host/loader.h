@@ -0,0 +1,32 @@
+#ifndef __LOADER_H__
+#define __LOADER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event_loop.h"
+#include "enclave_utils.h"
+#include "sha256.h"
+
+// A LoadSM or LoadCachedSM handled by the loader pool. Installing a TA and
+// opening its sessions takes long, the event loops keep serving the other
+// sockets meanwhile
+typedef struct load_job {
+  LoopCall call;          // completion, run by the loop that submitted the job
+  EventLoop *loop;
+  CommandCode code;
+  unsigned char payload[LOAD_HEADER_SIZE + SHA256_SIZE];  // LoadSM: header only
+  uint32_t size;          // size of the command payload
+  TaUpload *upload;       // LoadSM: binary received, not installed yet
+  ResultMessage result;   // set by the loader
+  void *arg;
+  size_t slot;
+  struct load_job *next;
+} LoadJob;
+
+int loader_init(unsigned int threads);
+
+// Run a job on a loader thread, then job->call on job->loop
+void loader_submit(LoadJob *job);
+
+#endif
@@ -0,0 +1,181 @@
+#include "local_events.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "event_loop.h"
+#include "enclave_utils.h"
+#include "utils.h"
+
+// Deliveries made per loop iteration, before the sockets are polled again
+#define LOCAL_DRAIN_BATCH 64
+
+// Events queued by a worker beyond this are dropped. A cycle of local
+// connections never ends, this bounds the memory it takes
+#define LOCAL_QUEUE_MAX   65536
+
+// Every worker queues the outputs of its own invocations, an input is handled
+// by the worker that produced it
+static __thread LocalEvent *queue_head;
+static __thread LocalEvent *queue_tail;
+static __thread unsigned int queue_len;
+static __thread int drain_scheduled;
+static __thread int draining;
+
+// Drops are reported at most once a second, a full queue usually drops a
+// lot of events
+static __thread unsigned long dropped;
+static __thread time_t drop_reported;
+
+static void local_events_schedule(void);
+
+
+/*
+  Take the first queued event and the following ones for the same module,
+  looking at most LOCAL_DRAIN_BATCH events ahead. The order of the events of
+  a module is kept
+
+  @batch: set to the events taken
+
+  @return: number of events taken
+*/
+static unsigned int local_events_take(LocalEvent **batch) {
+  LocalEvent **link = &queue_head;
+  LocalEvent *prev = NULL;
+  uint16_t to_sm = queue_head->to_sm;
+  unsigned int count = 0;
+
+  for(unsigned int seen = 0; *link != NULL && seen < LOCAL_DRAIN_BATCH &&
+                              count < MAX_INPUT_BATCH; seen++) {
+    LocalEvent *ev = *link;
+
+    if(ev->to_sm != to_sm) {
+      prev = ev;
+      link = &ev->next;
+      continue;
+    }
+
+    *link = ev->next;
+    if(queue_tail == ev)
+      queue_tail = prev;
+    batch[count++] = ev;
+  }
+
+  queue_len -= count;
+  return count;
+}
+
+
+/*
+  Deliver the queued events in order. Inputs queued meanwhile are appended,
+  so a chain of local connections is followed iteratively. The events
+  waiting for the same module are delivered together
+
+  @budget: maximum number of events delivered
+*/
+static void local_events_drain(unsigned int budget) {
+  LocalEvent *batch[MAX_INPUT_BATCH];
+  ModuleInput inputs[MAX_INPUT_BATCH];
+
+  draining = 1;
+
+  while(budget > 0 && queue_head != NULL) {
+    unsigned int count = local_events_take(batch);
+
+    for(unsigned int i = 0; i < count; i++) {
+      inputs[i].conn_id = batch[i]->conn_id;
+      inputs[i].size = batch[i]->size;
+      inputs[i].encrypt = batch[i]->data;
+      inputs[i].tag = batch[i]->tag;
+    }
+
+    reactive_handle_inputs(batch[0]->to_sm, inputs, count);
+
+    for(unsigned int i = 0; i < count; i++)
+      free(batch[i]);
+    budget = budget > count ? budget - count : 0;
+  }
+
+  draining = 0;
+}
+
+
+static void local_events_run(void *arg) {
+  (void) arg;
+
+  drain_scheduled = 0;
+  local_events_drain(LOCAL_DRAIN_BATCH);
+
+  // the rest waits for the network events of the next iteration
+  if(queue_head != NULL && !drain_scheduled)
+    local_events_schedule();
+}
+
+
+static void local_events_schedule(void) {
+  EventLoop *loop = event_loop_current();
+
+  if(loop != NULL && event_loop_post(loop, local_events_run, NULL)) {
+    drain_scheduled = 1;
+    return;
+  }
+
+  // outside of a loop, the outermost delivery empties the queue
+  if(!draining)
+    local_events_drain((unsigned int) -1);
+}
+
+
+/*
+  Queue an output of a module for delivery to a module of this event
+  manager. The data is copied, the buffers of the invocation that produced
+  it can be reused as soon as this returns
+
+  @to_sm: destination module
+  @conn_id: connection
+  @encrypt: ciphertext
+  @size: ciphertext size
+  @tag: MAC, 16 bytes
+*/
+void local_events_push(uint16_t to_sm, uint16_t conn_id,
+                    unsigned char *encrypt, uint32_t size, unsigned char *tag) {
+  LocalEvent *ev;
+
+  if(queue_len >= LOCAL_QUEUE_MAX) {
+    time_t now = time(NULL);
+
+    dropped++;
+    if(now != drop_reported) {
+      printf("local event queue full: %lu dropped, last output on connection %d\n",
+                dropped, conn_id);
+      dropped = 0;
+      drop_reported = now;
+    }
+    return;
+  }
+
+  ev = malloc_aligned(sizeof(LocalEvent) + size);
+  if(ev == NULL) {
+    printf("no memory for local event, output on connection %d dropped\n", conn_id);
+    return;
+  }
+
+  ev->next = NULL;
+  ev->to_sm = to_sm;
+  ev->conn_id = conn_id;
+  ev->size = size;
+  memcpy(ev->tag, tag, sizeof(ev->tag));
+  memcpy(ev->data, encrypt, size);
+
+  if(queue_tail == NULL)
+    queue_head = ev;
+  else
+    queue_tail->next = ev;
+  queue_tail = ev;
+  queue_len++;
+
+  if(!drain_scheduled)
+    local_events_schedule();
+}
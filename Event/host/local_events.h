@@ -0,0 +1,20 @@
+#ifndef __LOCAL_EVENTS_H__
+#define __LOCAL_EVENTS_H__
+
+#include <stdint.h>
+
+// Output of a module to a connection whose other end is a module of this
+// event manager, delivered as an input once the current one is done
+typedef struct local_event {
+  struct local_event *next;
+  uint16_t to_sm;
+  uint16_t conn_id;
+  uint32_t size;
+  unsigned char tag[16];
+  unsigned char data[];
+} LocalEvent;
+
+void local_events_push(uint16_t to_sm, uint16_t conn_id,
+                    unsigned char *encrypt, uint32_t size, unsigned char *tag);
+
+#endif
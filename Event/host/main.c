@@ -1,163 +1,229 @@
-#include <stdio.h> 
-#include <stdlib.h> 
-#include <string.h> 
-#include <errno.h>  
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 
-#include <netdb.h> 
-#include <netinet/in.h> 
-#include <sys/socket.h> 
-#include <sys/types.h> 
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
-#include <unistd.h>   //close  
-#include <arpa/inet.h>    //close 
-#include <sys/time.h> //FD_SET, FD_ISSET, FD_ZERO macros 
+#include <unistd.h>   //close, getopt
+#include <arpa/inet.h>    //close
 
-#include "event_manager.h"
+#include "enclave_utils.h"
+#include "event_loop.h"
 #include "networking.h"
+#include "outbound.h"
+#include "module.h"
+#include "loader.h"
+#include "manifest.h"
 
-#define PORT 1236 
+#define PORT 1236
 #define SA struct sockaddr
-     
-#define TRUE   1  
-#define FALSE  0  
-#define MAX 100000
-  
-// Driver function 
-int main() 
-{
 
-    int opt = TRUE;   
-    int master_socket, addrlen, new_socket, client_socket[30],  
-          max_clients = 30 , activity, i, valread, sd;   
-    int max_sd;   
+#define TRUE   1
+#define FALSE  0
+
+#define MAX_WORKERS 64
+#define DEFAULT_LOADERS 4
+
+typedef struct worker {
+    int id;
+    pthread_t thread;
+    EventLoop loop;
+} Worker;
+
+static Worker workers[MAX_WORKERS];
+
+//Creates a socket listening on PORT. Every worker owns one of them,
+//SO_REUSEPORT makes the kernel spread incoming connections between them
+static int create_listener(void)
+{
+    int opt = TRUE;
+    int master_socket;
     struct sockaddr_in address;
-         
-    //set of socket descriptors  
-    fd_set readfds; 
-     
-    //initialise all client_socket[] to 0 so not checked  
-    for (i = 0; i < max_clients; i++)   
-    {   
-        client_socket[i] = 0;   
-    } 
-
-    //create a master socket  
-    if( (master_socket = socket(AF_INET , SOCK_STREAM , 0)) == 0)   
-    {   
-        perror("socket failed");   
-        exit(EXIT_FAILURE);   
-    }   
-     
-    //set master socket to allow multiple connections ,  
-    //this is just a good habit, it will work without this  
-    if( setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt)) < 0)   
-    {   
-        perror("setsockopt");   
-        exit(EXIT_FAILURE);   
-    }   
-   
-    bzero(&address, sizeof(address)); 
-    
-    //type of socket created  
-    address.sin_family = AF_INET;   
-    address.sin_addr.s_addr = INADDR_ANY;   
-    address.sin_port = htons(PORT);  
+
+    //create a master socket
+    if( (master_socket = socket(AF_INET , SOCK_STREAM , 0)) < 0)
+    {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    //set master socket to allow multiple connections ,
+    //this is just a good habit, it will work without this
+    if( setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt)) < 0)
+    {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    //allow the other workers to bind the same port
+    if( setsockopt(master_socket, SOL_SOCKET, SO_REUSEPORT, (char *)&opt, sizeof(opt)) < 0)
+    {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    bzero(&address, sizeof(address));
+
+    //type of socket created
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(PORT);
 
     //printf(" ip is : %s , port : %d\n",
-                     //inet_ntoa(address.sin_addr) , ntohs(address.sin_port));  
-         
-    //bind the socket to localhost port 1236  
-    if (bind(master_socket, (struct sockaddr *)&address, sizeof(address))<0)   
-    {   
-        perror("bind failed");   
-        exit(EXIT_FAILURE);   
-    }   
-    //printf("Listener on port %d \n", PORT);   
-         
-    //try to specify maximum of 3 pending connections for the master socket  
-    if (listen(master_socket, 3) < 0)   
-    {   
-        perror("listen");   
-        exit(EXIT_FAILURE);   
-    }   
-         
-    //accept the incoming connection  
-    addrlen = sizeof(address);   
+                     //inet_ntoa(address.sin_addr) , ntohs(address.sin_port));
+
+    //bind the socket to localhost port 1236
+    if (bind(master_socket, (struct sockaddr *)&address, sizeof(address))<0)
+    {
+        perror("bind failed");
+        exit(EXIT_FAILURE);
+    }
+    //printf("Listener on port %d \n", PORT);
+
+    //let the kernel queue as many pending connections as it allows,
+    //a deployment opens many of them at once
+    if (listen(master_socket, SOMAXCONN) < 0)
+    {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    return master_socket;
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+
+    event_loop_run(&worker->loop);
+    event_loop_destroy(&worker->loop);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-w workers] [-s sessions per module] "
+                    "[-b session budget] [-l loaders] [-m manifest] [-r]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+// Driver function
+int main(int argc, char **argv)
+{
+    int num_workers = 1;
+    int num_sessions = 0;
+    int budget = 0;
+    int num_loaders = DEFAULT_LOADERS;
+    const char *manifest = NULL;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "w:s:b:l:m:r")) != -1)
+    {
+        switch (c)
+        {
+            case 'w':
+                num_workers = atoi(optarg);
+                break;
+            case 's':
+                num_sessions = atoi(optarg);
+                if (num_sessions < 1)
+                    usage(argv[0]);
+                break;
+            case 'b':
+                budget = atoi(optarg);
+                if (budget < 0)
+                    usage(argv[0]);
+                break;
+            case 'l':
+                num_loaders = atoi(optarg);
+                if (num_loaders < 1)
+                    usage(argv[0]);
+                break;
+            case 'm':
+                manifest = optarg;
+                break;
+            case 'r':
+                //every peer must understand RemoteOutputBatch
+                outbound_set_batching(1);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (num_workers < 1 || num_workers > MAX_WORKERS)
+    {
+        fprintf(stderr, "workers must be between 1 and %d\n", MAX_WORKERS);
+        exit(EXIT_FAILURE);
+    }
+
+    //a worker holds at most one session at a time, so by default a module
+    //never makes a worker wait
+    if (num_sessions == 0)
+    {
+        num_sessions = num_workers;
+    }
+
+    //with a budget, the TEE may hold fewer modules than the node hosts:
+    //the least recently used ones are closed and reopened on demand
+    if (modules_init(num_sessions, budget, restore_module_keys) != TEEC_SUCCESS)
+    {
+        fprintf(stderr, "TEEC_InitializeContext failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //a peer closing its socket early must not kill the process on write
+    signal(SIGPIPE, SIG_IGN);
+
+    //modules are loaded by their own threads, so that opening the sessions
+    //of a TA does not hold up the traffic of the workers
+    if (!loader_init(num_loaders))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    //restore the modules and connections of the node before taking any
+    //traffic, its peers may start sending as soon as the port is open
+    if (manifest != NULL && !manifest_load(manifest, num_loaders))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    //every worker has its own listener and epoll instance, nothing
+    //but the module and connection registries is shared between them
+    for (i = 0; i < num_workers; i++)
+    {
+        workers[i].id = i;
+        if (event_loop_init(&workers[i].loop, create_listener()) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
     puts("Waiting for connections ...");
 
-    while(TRUE)   
-    {   
-        //clear the socket set  
-        FD_ZERO(&readfds);   
-     
-        //add master socket to set  
-        FD_SET(master_socket, &readfds);   
-        max_sd = master_socket;   
-             
-        //add child sockets to set  
-        for ( i = 0 ; i < max_clients ; i++)   
-        {   
-            //socket descriptor  
-            sd = client_socket[i];   
-                 
-            //if valid socket descriptor then add to read list  
-            if(sd > 0)   
-                FD_SET( sd , &readfds);   
-                 
-            //highest file descriptor number, need it for the select function  
-            if(sd > max_sd)   
-                max_sd = sd;   
-        }   
-     
-        //wait for an activity on one of the sockets , timeout is NULL ,  
-        //so wait indefinitely  
-        activity = select( max_sd + 1 , &readfds , NULL , NULL , NULL);   
-       
-        if ((activity < 0) && (errno!=EINTR))   
-        {   
-            printf("select error");   
-        }   
-             
-        //If something happened on the master socket ,  
-        //then its an incoming connection  
-        if (FD_ISSET(master_socket, &readfds)) {  
-             
-            if ((new_socket = accept(master_socket,  
-                    (struct sockaddr *)&address, (socklen_t*)&addrlen))<0)   
-            {   
-                perror("accept");   
-                exit(EXIT_FAILURE);   
-            } 
-            //printf("accept new socket:%d\n", new_socket);  
-             
-            //inform user of socket number - used in send and receive commands  
-            //printf("New connection , socket fd is %d , ip is : %s , port : %d\n",
-                    //new_socket , inet_ntoa(address.sin_addr) , ntohs(address.sin_port)); 
-               
-            //add new socket to array of sockets  
-            for (i = 0; i < max_clients; i++)   
-            {   
-                //if position is empty  
-                if( client_socket[i] == 0 )   
-                {   
-                    client_socket[i] = new_socket;   
-                    //printf("Adding new socket %d to list of sockets as %d\n" , new_socket , i);    
-                    break;   
-                }   
-            }   
-        }   
-             
-        //else its some IO operation on some other socket 
-        for (i = 0; i < max_clients; i++)   
-        {   
-            sd = client_socket[i];   
-                 
-            if (FD_ISSET(sd , &readfds))   
-            {
-                int res = event_manager_run(sd, address, addrlen, client_socket, i);
-                
-            }
-        } 
-    }  
-
-} 
+    //worker 0 runs on the main thread
+    for (i = 1; i < num_workers; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    worker_main(&workers[0]);
+
+    for (i = 1; i < num_workers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    return 0;
+}
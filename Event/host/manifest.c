@@ -0,0 +1,359 @@
+#include "manifest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "connection.h"
+#include "enclave_utils.h"
+#include "module.h"
+#include "stats.h"
+#include "utils.h"
+
+typedef struct manifest_key {
+  unsigned char data[KEY_DATA_SIZE];
+  struct manifest_key *next;
+} ManifestKey;
+
+typedef struct manifest_module {
+  uint16_t module_id;
+  TEEC_UUID uuid;
+  ManifestKey *keys;
+  ManifestKey *keys_tail;
+} ManifestModule;
+
+typedef struct manifest {
+  ManifestModule *modules;
+  size_t num_modules;
+  size_t cap_modules;
+  size_t next_module;         // next one to open, taken by the threads
+  pthread_mutex_t lock;
+  int failed;
+} Manifest;
+
+
+static int hex_value(char c) {
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+
+/*
+  Decode hexadecimal digits, dashes are skipped so that a uuid can be read
+
+  @return: 1 if exactly size bytes were decoded, 0 otherwise
+*/
+static int parse_hex(const char *text, unsigned char *out, size_t size) {
+  size_t n = 0;
+
+  while(*text != '\0') {
+    int high, low;
+
+    if(*text == '-') {
+      text++;
+      continue;
+    }
+
+    high = hex_value(text[0]);
+    low = high < 0 ? -1 : hex_value(text[1]);
+    if(low < 0 || n == size)
+      return 0;
+
+    out[n++] = (high << 4) | low;
+    text += 2;
+  }
+
+  return n == size;
+}
+
+
+static int parse_u16(const char *text, uint16_t *out) {
+  char *end;
+  unsigned long value = strtoul(text, &end, 10);
+
+  if(*text == '\0' || *end != '\0' || value > 0xFFFF)
+    return 0;
+
+  *out = value;
+  return 1;
+}
+
+
+static ManifestModule *find_module(Manifest *m, uint16_t module_id) {
+  for(size_t i = 0; i < m->num_modules; i++) {
+    if(m->modules[i].module_id == module_id)
+      return &m->modules[i];
+  }
+
+  return NULL;
+}
+
+
+static int add_module(Manifest *m, char **fields, int count) {
+  unsigned char uuid[16];
+  ManifestModule *module;
+  uint16_t module_id;
+
+  if(count != 3 || !parse_u16(fields[1], &module_id) ||
+      !parse_hex(fields[2], uuid, sizeof(uuid)) ||
+      find_module(m, module_id) != NULL)
+    return 0;
+
+  if(m->num_modules == m->cap_modules) {
+    size_t cap = m->cap_modules == 0 ? 16 : 2 * m->cap_modules;
+    ManifestModule *modules = realloc(m->modules, cap * sizeof(ManifestModule));
+
+    if(modules == NULL)
+      return 0;
+
+    m->modules = modules;
+    m->cap_modules = cap;
+  }
+
+  module = &m->modules[m->num_modules++];
+  module->module_id = module_id;
+  module->uuid.timeLow = (uint32_t) uuid[0] << 24 | uuid[1] << 16 |
+                            uuid[2] << 8 | uuid[3];
+  module->uuid.timeMid = uuid[4] << 8 | uuid[5];
+  module->uuid.timeHiAndVersion = uuid[6] << 8 | uuid[7];
+  memcpy(module->uuid.clockSeqAndNode, uuid + 8, 8);
+  module->keys = NULL;
+  module->keys_tail = NULL;
+  return 1;
+}
+
+
+// Keys refer to a module listed before them
+static int add_key(Manifest *m, char **fields, int count) {
+  ManifestModule *module;
+  ManifestKey *key;
+  uint16_t module_id;
+
+  if(count != 3 || !parse_u16(fields[1], &module_id) ||
+      (module = find_module(m, module_id)) == NULL)
+    return 0;
+
+  key = malloc_aligned(sizeof(ManifestKey));
+  if(key == NULL)
+    return 0;
+
+  if(!parse_hex(fields[2], key->data, KEY_DATA_SIZE)) {
+    free(key);
+    return 0;
+  }
+
+  key->next = NULL;
+
+  if(module->keys_tail == NULL)
+    module->keys = key;
+  else
+    module->keys_tail->next = key;
+  module->keys_tail = key;
+  return 1;
+}
+
+
+// Connections are only added once every module is open
+static int parse_connection(char **fields, int count, Connection *connection) {
+  memset(connection, 0, sizeof(*connection));
+
+  if(count < 4 || !parse_u16(fields[1], &connection->conn_id) ||
+      !parse_u16(fields[2], &connection->to_sm))
+    return 0;
+
+  if(count == 4 && strcmp(fields[3], "local") == 0) {
+    connection->local = 1;
+    return 1;
+  }
+
+  return count == 5 && inet_pton(AF_INET, fields[3], connection->to_address.u8) == 1 &&
+          parse_u16(fields[4], &connection->to_port);
+}
+
+
+// Opens the modules of the manifest one after the other, in parallel with
+// the other threads
+static void *open_modules(void *arg) {
+  Manifest *m = arg;
+
+  while(1) {
+    ManifestModule *module;
+    uint32_t err_origin = 0;
+    TEEC_Result rc;
+
+    pthread_mutex_lock(&m->lock);
+    module = m->next_module < m->num_modules && !m->failed ?
+                &m->modules[m->next_module++] : NULL;
+    pthread_mutex_unlock(&m->lock);
+
+    if(module == NULL)
+      return NULL;
+
+    rc = modules_add(module->module_id, &module->uuid, &err_origin);
+    if(rc != TEEC_SUCCESS) {
+      fprintf(stderr, "manifest: module %d cannot be opened (0x%x, orig=%d)\n",
+                module->module_id, rc, (int) err_origin);
+      pthread_mutex_lock(&m->lock);
+      m->failed = 1;
+      pthread_mutex_unlock(&m->lock);
+      return NULL;
+    }
+
+    for(ManifestKey *key = module->keys; key != NULL; key = key->next) {
+      // handle_set_key would exit without naming the module
+      rc = set_module_key(modules_get(module->module_id), key->data, &err_origin);
+      if(rc != TEEC_SUCCESS) {
+        fprintf(stderr, "manifest: key of module %d rejected (0x%x, orig=%d)\n",
+                  module->module_id, rc, (int) err_origin);
+        pthread_mutex_lock(&m->lock);
+        m->failed = 1;
+        pthread_mutex_unlock(&m->lock);
+        return NULL;
+      }
+    }
+  }
+}
+
+
+static void manifest_free(Manifest *m) {
+  for(size_t i = 0; i < m->num_modules; i++) {
+    ManifestKey *key = m->modules[i].keys;
+
+    while(key != NULL) {
+      ManifestKey *next = key->next;
+
+      free(key);
+      key = next;
+    }
+  }
+
+  free(m->modules);
+  pthread_mutex_destroy(&m->lock);
+}
+
+
+/*
+  Open the modules of a manifest, give them their keys and add the
+  connections. The modules are opened by several threads, the call returns
+  once they are all ready
+
+  @path: manifest file
+  @threads: number of modules opened in parallel
+
+  @return: 1 on success, 0 on error (reported on stderr)
+*/
+int manifest_load(const char *path, unsigned int threads) {
+  Manifest m;
+  Connection *connections = NULL;
+  size_t num_connections = 0, cap_connections = 0;
+  pthread_t *workers;
+  unsigned int started = 0;
+  char line[512];
+  int line_no = 0;
+  int ok = 1;
+  uint64_t start = stats_now();
+  FILE *file = fopen(path, "r");
+
+  if(file == NULL) {
+    perror(path);
+    return 0;
+  }
+
+  memset(&m, 0, sizeof(m));
+  pthread_mutex_init(&m.lock, NULL);
+
+  while(ok && fgets(line, sizeof(line), file) != NULL) {
+    char *fields[6];
+    int count = 0;
+    char *comment = strchr(line, '#');
+
+    line_no++;
+    if(comment != NULL)
+      *comment = '\0';
+
+    for(char *field = strtok(line, " \t\r\n"); field != NULL && count < 6;
+          field = strtok(NULL, " \t\r\n"))
+      fields[count++] = field;
+
+    if(count == 0)
+      continue;
+
+    if(strcmp(fields[0], "module") == 0) {
+      ok = add_module(&m, fields, count);
+    }
+    else if(strcmp(fields[0], "key") == 0) {
+      ok = add_key(&m, fields, count);
+    }
+    else if(strcmp(fields[0], "connection") == 0) {
+      if(num_connections == cap_connections) {
+        size_t cap = cap_connections == 0 ? 64 : 2 * cap_connections;
+        Connection *grown = realloc(connections, cap * sizeof(Connection));
+
+        if(grown == NULL) {
+          fprintf(stderr, "manifest: out of memory\n");
+          ok = 0;
+          break;
+        }
+        connections = grown;
+        cap_connections = cap;
+      }
+      ok = parse_connection(fields, count, &connections[num_connections]);
+      num_connections += ok;
+    }
+    else {
+      ok = 0;
+    }
+
+    if(!ok)
+      fprintf(stderr, "%s:%d: invalid record\n", path, line_no);
+  }
+  fclose(file);
+
+  if(threads > m.num_modules)
+    threads = m.num_modules;
+
+  workers = malloc_aligned((threads > 0 ? threads : 1) * sizeof(pthread_t));
+  if(ok && workers == NULL)
+    ok = 0;
+
+  for(unsigned int i = 0; ok && i < threads; i++, started++) {
+    if(pthread_create(&workers[i], NULL, open_modules, &m) != 0) {
+      perror("pthread_create");
+      break;
+    }
+  }
+
+  // fewer threads than asked still open every module
+  if(ok && started == 0 && m.num_modules > 0)
+    open_modules(&m);
+
+  for(unsigned int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+
+  ok = ok && !m.failed;
+
+  for(size_t i = 0; ok && i < num_connections; i++) {
+    if(connections_add(&connections[i]) != 1) {
+      fprintf(stderr, "manifest: connection %d cannot be added\n",
+                connections[i].conn_id);
+      ok = 0;
+    }
+  }
+
+  if(ok)
+    printf("manifest: %zu modules and %zu connections ready in %llu ms\n",
+              m.num_modules, num_connections,
+              (unsigned long long) (stats_now() - start) / 1000000);
+
+  free(connections);
+  manifest_free(&m);
+  return ok;
+}
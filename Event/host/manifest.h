@@ -0,0 +1,20 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+/*
+  Modules and connections restored at startup, before the event manager
+  listens. One record per line, '#' starts a comment:
+
+    module <module id> <uuid>
+    connection <conn id> <to module> local
+    connection <conn id> <to module> <ipv4 address> <port>
+    key <module id> <hex SetKey data: associated data - cipher - tag>
+
+  The TA of a module must be installed already (e.g. by an earlier LoadSM).
+  Keys are given to their module in file order, once it is open.
+*/
+
+// Returns 0 if the manifest cannot be read or a record fails
+int manifest_load(const char *path, unsigned int threads);
+
+#endif
@@ -0,0 +1,510 @@
+#include "module.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// module_id is 16 bits: the registry is a two-level array indexed by the
+// module id, with pages allocated on first use
+#define PAGE_BITS 8
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define NUM_PAGES (65536 / PAGE_SIZE)
+
+typedef struct Page
+{
+    Module* modules[PAGE_SIZE];
+} Page;
+
+static Page* pages[NUM_PAGES];
+
+static pthread_rwlock_t modules_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static TEEC_Context tee_ctx;
+static unsigned int sessions_per_module = 1;
+
+// Sessions open across all modules, counted only with a budget. budget_lock
+// is taken before the lock of a module, lru_lock after it.
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int session_budget;
+static unsigned int open_sessions;
+
+// Modules with idle sessions, most recently used first
+static pthread_mutex_t lru_lock = PTHREAD_MUTEX_INITIALIZER;
+static Module* lru_head;
+static Module* lru_tail;
+static ModuleRestore restore_module;
+
+TEEC_Result modules_init(unsigned int sessions, unsigned int budget,
+                            ModuleRestore restore)
+{
+    sessions_per_module = sessions;
+    session_budget = budget;
+    restore_module = restore;
+
+    return TEEC_InitializeContext(NULL, &tee_ctx);
+}
+
+// Keeps module in the LRU list while it has idle sessions, in front when it
+// was just used. Called with the lock of the module held.
+static void lru_update(Module* module)
+{
+    if (session_budget == 0)
+        return;
+
+    pthread_mutex_lock(&lru_lock);
+
+    if (module->in_lru) {
+        if (module->lru_prev != NULL)
+            module->lru_prev->lru_next = module->lru_next;
+        else
+            lru_head = module->lru_next;
+
+        if (module->lru_next != NULL)
+            module->lru_next->lru_prev = module->lru_prev;
+        else
+            lru_tail = module->lru_prev;
+
+        module->in_lru = 0;
+    }
+
+    if (module->idle != NULL) {
+        module->lru_prev = NULL;
+        module->lru_next = lru_head;
+        if (lru_head != NULL)
+            lru_head->lru_prev = module;
+        else
+            lru_tail = module;
+        lru_head = module;
+        module->in_lru = 1;
+    }
+
+    pthread_mutex_unlock(&lru_lock);
+}
+
+// Finds the module with an idle session that was used the longest time ago.
+// It may have none left once its lock is taken.
+static Module* lru_victim(const Module* except)
+{
+    pthread_mutex_lock(&lru_lock);
+    Module* victim = lru_tail;
+
+    if (victim == except)
+        victim = victim->lru_prev;
+    pthread_mutex_unlock(&lru_lock);
+
+    return victim;
+}
+
+// Takes an idle session out of module, NULL if it has none
+static ModuleSession* take_idle(Module* module)
+{
+    pthread_mutex_lock(&module->lock);
+    ModuleSession* session = module->idle;
+
+    if (session != NULL) {
+        module->idle = session->next;
+        module->num_open--;
+        lru_update(module);
+    }
+    pthread_mutex_unlock(&module->lock);
+
+    return session;
+}
+
+// Closes a session taken with take_idle and gives its slot back
+static void close_taken(Module* module, ModuleSession* session)
+{
+    TEEC_CloseSession(&session->sess);
+
+    pthread_mutex_lock(&module->lock);
+    session->next = module->closed;
+    module->closed = session;
+    // waiters may open it again
+    pthread_cond_broadcast(&module->idle_cond);
+    pthread_mutex_unlock(&module->lock);
+}
+
+static void budget_release(void)
+{
+    if (session_budget == 0)
+        return;
+
+    pthread_mutex_lock(&budget_lock);
+    open_sessions--;
+    pthread_mutex_unlock(&budget_lock);
+}
+
+// Opens the session of a slot, evicting idle sessions of other modules
+// first if the budget is reached. When every session is busy the budget is
+// exceeded rather than waiting, the sessions in use may be waiting for this
+// one. Only the accounting holds budget_lock, sessions open in parallel.
+static TEEC_Result open_session(Module* module, ModuleSession* session,
+                                    uint32_t* err_origin)
+{
+    TEEC_Result rc;
+
+    if (session_budget > 0) {
+        pthread_mutex_lock(&budget_lock);
+        // reserved before evicting, so that parallel opens do not all
+        // count the same free room
+        open_sessions++;
+
+        while (open_sessions > session_budget) {
+            Module* victim;
+            ModuleSession* evicted = NULL;
+
+            // a victim whose last idle session was just taken has left
+            // the list, look again
+            while (evicted == NULL && (victim = lru_victim(module)) != NULL)
+                evicted = take_idle(victim);
+
+            if (evicted == NULL)
+                break;
+
+            open_sessions--;
+            pthread_mutex_unlock(&budget_lock);
+            close_taken(victim, evicted);
+            pthread_mutex_lock(&budget_lock);
+        }
+
+        pthread_mutex_unlock(&budget_lock);
+    }
+
+    rc = TEEC_OpenSession(&tee_ctx, &session->sess, &module->uuid,
+                          TEEC_LOGIN_PUBLIC, NULL, NULL, err_origin);
+    if (rc != TEEC_SUCCESS)
+        budget_release();
+
+    return rc;
+}
+
+static void close_sessions(Module* module)
+{
+    ModuleSession* session;
+
+    while ((session = take_idle(module)) != NULL) {
+        budget_release();
+        close_taken(module, session);
+    }
+}
+
+TEEC_Result modules_add(uint16_t module_id, const TEEC_UUID* uuid,
+                            uint32_t* err_origin)
+{
+    unsigned int index = module_id >> PAGE_BITS;
+    unsigned int slot = module_id & (PAGE_SIZE - 1);
+    Module* record = malloc_aligned(sizeof(Module));
+    Module* replaced = NULL;
+    TEEC_Result rc;
+    int ret = 1;
+
+    if (record == NULL)
+        return TEEC_ERROR_OUT_OF_MEMORY;
+
+    record->sessions = malloc_aligned(sessions_per_module * sizeof(ModuleSession));
+    if (record->sessions == NULL) {
+        free(record);
+        return TEEC_ERROR_OUT_OF_MEMORY;
+    }
+
+    record->module_id = module_id;
+    record->uuid = *uuid;
+    record->num_sessions = sessions_per_module;
+    record->idle = NULL;
+    record->closed = NULL;
+    record->num_open = 0;
+    record->restoring = 0;
+    record->retired = 0;
+    record->lru_prev = NULL;
+    record->lru_next = NULL;
+    record->in_lru = 0;
+    record->keys = NULL;
+    record->keys_tail = NULL;
+
+    // the other sessions are opened when they are needed
+    for (unsigned int i = 1; i < sessions_per_module; i++) {
+        record->sessions[i].next = record->closed;
+        record->closed = &record->sessions[i];
+    }
+
+    rc = open_session(record, &record->sessions[0], err_origin);
+    if (rc != TEEC_SUCCESS) {
+        free(record->sessions);
+        free(record);
+        return rc;
+    }
+
+    record->idle = &record->sessions[0];
+    record->idle->next = NULL;
+    record->num_open = 1;
+
+    pthread_mutex_init(&record->lock, NULL);
+    pthread_cond_init(&record->idle_cond, NULL);
+    record->shm_free = NULL;
+    record->no_batch = 0;
+    pthread_mutex_init(&record->shm_lock, NULL);
+
+    pthread_rwlock_wrlock(&modules_lock);
+
+    if (pages[index] == NULL) {
+        pages[index] = malloc_aligned(sizeof(Page));
+
+        if (pages[index] != NULL)
+            memset(pages[index], 0, sizeof(Page));
+    }
+
+    if (pages[index] == NULL) {
+        ret = 0;
+    }
+    else {
+        // a replaced record may still be in use by another worker
+        replaced = pages[index]->modules[slot];
+        pages[index]->modules[slot] = record;
+    }
+
+    pthread_rwlock_unlock(&modules_lock);
+
+    if (!ret) {
+        close_sessions(record);
+        free(record->sessions);
+        free(record);
+        return TEEC_ERROR_OUT_OF_MEMORY;
+    }
+
+    pthread_mutex_lock(&record->lock);
+    lru_update(record);
+    pthread_mutex_unlock(&record->lock);
+
+    // new lookups do not find the replaced module, its idle sessions are
+    // not needed anymore and the busy ones are closed when released
+    if (replaced != NULL) {
+        pthread_mutex_lock(&replaced->lock);
+        replaced->retired = 1;
+        pthread_mutex_unlock(&replaced->lock);
+
+        close_sessions(replaced);
+    }
+
+    return TEEC_SUCCESS;
+}
+
+Module* modules_get(uint16_t module_id)
+{
+    unsigned int index = module_id >> PAGE_BITS;
+    unsigned int slot = module_id & (PAGE_SIZE - 1);
+    Module* found = NULL;
+
+    pthread_rwlock_rdlock(&modules_lock);
+
+    if (pages[index] != NULL)
+        found = pages[index]->modules[slot];
+
+    pthread_rwlock_unlock(&modules_lock);
+    return found;
+}
+
+static int shm_alloc(TEEC_SharedMemory* shm, size_t size)
+{
+    memset(shm, 0, sizeof(*shm));
+    shm->size = size;
+    shm->flags = TEEC_MEM_INPUT | TEEC_MEM_OUTPUT;
+
+    return TEEC_AllocateSharedMemory(&tee_ctx, shm) == TEEC_SUCCESS;
+}
+
+ShmSet* module_shm_acquire(Module* module)
+{
+    pthread_mutex_lock(&module->shm_lock);
+    ShmSet* set = module->shm_free;
+
+    if (set != NULL)
+        module->shm_free = set->next;
+    pthread_mutex_unlock(&module->shm_lock);
+
+    if (set != NULL)
+        return set;
+
+    set = malloc_aligned(sizeof(ShmSet));
+    if (set == NULL)
+        return NULL;
+
+    if (!shm_alloc(&set->conn_id, SHM_CONN_ID_SIZE)) {
+        free(set);
+        return NULL;
+    }
+
+    if (!shm_alloc(&set->data, SHM_DATA_SIZE)) {
+        TEEC_ReleaseSharedMemory(&set->conn_id);
+        free(set);
+        return NULL;
+    }
+
+    if (!shm_alloc(&set->tag, SHM_TAG_SIZE)) {
+        TEEC_ReleaseSharedMemory(&set->data);
+        TEEC_ReleaseSharedMemory(&set->conn_id);
+        free(set);
+        return NULL;
+    }
+
+    return set;
+}
+
+int module_shm_reserve(TEEC_SharedMemory* shm, size_t size)
+{
+    TEEC_SharedMemory grown;
+
+    if (shm->size >= size)
+        return 1;
+
+    if (size < 2 * shm->size)
+        size = 2 * shm->size;
+
+    // the previous buffer is kept if the new one cannot be allocated
+    if (!shm_alloc(&grown, size))
+        return 0;
+
+    TEEC_ReleaseSharedMemory(shm);
+    *shm = grown;
+    return 1;
+}
+
+void module_shm_release(Module* module, ShmSet* set)
+{
+    pthread_mutex_lock(&module->shm_lock);
+    set->next = module->shm_free;
+    module->shm_free = set;
+    pthread_mutex_unlock(&module->shm_lock);
+}
+
+int module_keep_key(Module* module, const unsigned char* data, size_t size)
+{
+    int ret = 1;
+
+    pthread_mutex_lock(&module->lock);
+
+    for (ModuleKey* key = module->keys; key != NULL; key = key->next) {
+        if (key->size == size && memcmp(key->data, data, size) == 0)
+            goto out;
+    }
+
+    ModuleKey* key = malloc_aligned(sizeof(ModuleKey) + size);
+    if (key == NULL) {
+        ret = 0;
+        goto out;
+    }
+
+    key->next = NULL;
+    key->size = size;
+    memcpy(key->data, data, size);
+
+    if (module->keys_tail != NULL)
+        module->keys_tail->next = key;
+    else
+        module->keys = key;
+    module->keys_tail = key;
+
+out:
+    pthread_mutex_unlock(&module->lock);
+    return ret;
+}
+
+ModuleSession* module_session_acquire(Module* module)
+{
+    ModuleSession* session;
+    uint32_t err_origin;
+    TEEC_Result rc;
+    int fresh;
+
+    pthread_mutex_lock(&module->lock);
+
+    while (1) {
+        // nobody uses a reopened TA before its keys are back
+        if (module->restoring) {
+            pthread_cond_wait(&module->idle_cond, &module->lock);
+            continue;
+        }
+
+        if (module->idle != NULL) {
+            session = module->idle;
+            module->idle = session->next;
+            if (module->idle == NULL)
+                lru_update(module);
+            pthread_mutex_unlock(&module->lock);
+            return session;
+        }
+
+        if (module->closed == NULL) {
+            pthread_cond_wait(&module->idle_cond, &module->lock);
+            continue;
+        }
+
+        session = module->closed;
+        module->closed = session->next;
+        fresh = module->num_open == 0;
+        module->num_open++;
+        module->restoring = fresh;
+        pthread_mutex_unlock(&module->lock);
+
+        rc = open_session(module, session, &err_origin);
+
+        pthread_mutex_lock(&module->lock);
+
+        if (rc == TEEC_SUCCESS)
+            break;
+
+        module->num_open--;
+        module->restoring = 0;
+        pthread_cond_broadcast(&module->idle_cond);
+
+        if (module->num_open == 0) {
+            // nothing to wait for, try again on the next invocation
+            session->next = module->closed;
+            module->closed = session;
+            pthread_mutex_unlock(&module->lock);
+            fprintf(stderr, "module %u: TEEC_OpenSession failed: 0x%x\n",
+                    module->module_id, rc);
+            return NULL;
+        }
+
+        // e.g. TEEC_ERROR_BUSY from a single session TA, the module runs
+        // with the sessions it has and the slot is not tried again
+        module->num_sessions--;
+    }
+
+    pthread_mutex_unlock(&module->lock);
+
+    if (fresh) {
+        if (restore_module != NULL)
+            restore_module(module, session);
+
+        pthread_mutex_lock(&module->lock);
+        module->restoring = 0;
+        pthread_cond_broadcast(&module->idle_cond);
+        pthread_mutex_unlock(&module->lock);
+    }
+
+    return session;
+}
+
+void module_session_release(Module* module, ModuleSession* session)
+{
+    pthread_mutex_lock(&module->lock);
+
+    if (module->retired) {
+        // not kept idle, nothing would ever close it without a budget
+        module->num_open--;
+        pthread_mutex_unlock(&module->lock);
+
+        budget_release();
+        close_taken(module, session);
+        return;
+    }
+
+    session->next = module->idle;
+    module->idle = session;
+    lru_update(module);
+    pthread_cond_signal(&module->idle_cond);
+    pthread_mutex_unlock(&module->lock);
+}
@@ -0,0 +1,114 @@
+#ifndef __MODULE_H__
+#define __MODULE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "tee_client_api.h"
+
+// Initial sizes, the buffers grow when an input or the outputs of a TA do
+// not fit
+#define SHM_CONN_ID_SIZE 32     // 16 outputs * 2 bytes
+#define SHM_DATA_SIZE    256    // 16 outputs * (1 length byte + payload)
+#define SHM_TAG_SIZE     256    // 16 outputs * 16 bytes
+
+// Buffers shared with the TEE once and passed as TEEC_MEMREF_PARTIAL_*
+// parameters, so that an invocation does not map temporary memory
+typedef struct ShmSet
+{
+    TEEC_SharedMemory conn_id;
+    TEEC_SharedMemory data;
+    TEEC_SharedMemory tag;
+    struct ShmSet*    next;
+} ShmSet;
+
+// A session runs one invocation at a time, a module has several of them so
+// that its inputs can be handled by different workers in parallel
+typedef struct ModuleSession
+{
+    TEEC_Session          sess;
+    struct ModuleSession* next;
+} ModuleSession;
+
+// Data of a TA_CMD_SET_KEY accepted by the module, given to it again when
+// its TA instance is opened after an eviction
+typedef struct ModuleKey
+{
+    struct ModuleKey* next;
+    size_t            size;
+    unsigned char     data[];
+} ModuleKey;
+
+// Everything needed to invoke a loaded module, found with a single lookup
+typedef struct Module
+{
+    uint16_t        module_id;
+    TEEC_UUID       uuid;
+    ModuleSession*  sessions;
+    unsigned int    num_sessions;
+    ModuleSession*  idle;
+    ModuleSession*  closed;     // slots whose session is not open
+    unsigned int    num_open;
+    int             restoring;  // the keys are given to a reopened TA
+    int             retired;    // replaced, sessions are closed on release
+    struct Module*  lru_prev;   // list of the modules with idle sessions,
+    struct Module*  lru_next;   // kept only with a session budget
+    int             in_lru;
+    ModuleKey*      keys;
+    ModuleKey*      keys_tail;
+    pthread_mutex_t lock;
+    pthread_cond_t  idle_cond;
+    ShmSet*         shm_free;
+    pthread_mutex_t shm_lock;
+    int             no_batch;   // the TA rejected TA_CMD_HANDLE_INPUT_BATCH
+} Module;
+
+// Brings a TA instance opened again after an eviction back to the state the
+// host knows of, called with the first session of the new instance.
+typedef void (*ModuleRestore)(Module* module, ModuleSession* session);
+
+// Opens the TEEC context shared by every module. sessions is the maximum
+// number of sessions of a module, it should not exceed what the TAs allow
+// (single instance TAs without TA_FLAG_MULTI_SESSION accept only one).
+// budget caps the sessions open across all modules, 0 for no limit: past
+// it the idle sessions of the least recently used modules are closed, and
+// restore is called when one of them is used again.
+TEEC_Result modules_init(unsigned int sessions, unsigned int budget,
+                            ModuleRestore restore);
+
+// Opens a session of a TA, which checks that it can run, and registers it.
+// More sessions are opened when the module is invoked by several workers at
+// once. A module loaded again under the same id replaces the previous one
+// for new lookups, the sessions of the previous one are closed as soon as
+// they are released.
+TEEC_Result modules_add(uint16_t module_id, const TEEC_UUID* uuid,
+                            uint32_t* err_origin);
+
+// We keep ownership of the returned Module, it is never freed so the pointer
+// stays valid. Returns NULL if module_id is unknown.
+Module* modules_get(uint16_t module_id);
+
+// Takes a set of shared buffers of the module. A set stays in use until the
+// outputs it holds are routed, which may invoke the same module again, so
+// the pool grows on demand. Returns NULL if the TEE is out of memory.
+ShmSet* module_shm_acquire(Module* module);
+
+void module_shm_release(Module* module, ShmSet* set);
+
+// Grows a buffer of a set to at least size bytes, its content is lost.
+// Returns 0 if the TEE is out of memory, the buffer is then unchanged.
+int module_shm_reserve(TEEC_SharedMemory* shm, size_t size);
+
+// Keeps the data of a key accepted by the module, for restore. The keys are
+// kept for the life of the module, a key set twice is kept once.
+int module_keep_key(Module* module, const unsigned char* data, size_t size);
+
+// Checks out an idle session, opening one if none is idle and the module has
+// fewer than its maximum, or waiting for one otherwise. It must be released
+// before routing the outputs of the invocation. Returns NULL if the module
+// has no session left and none can be opened.
+ModuleSession* module_session_acquire(Module* module);
+
+void module_session_release(Module* module, ModuleSession* session);
+
+#endif
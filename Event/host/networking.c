@@ -3,12 +3,19 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <arpa/inet.h>
 
 #include "utils.h"
 
 
 #define DEBUG_MSG 0
 
+// Every request allocates a command, a result and their messages: they are
+// recycled by the thread that frees them
+static __thread ObjectPool message_pool;
+static __thread ObjectPool command_pool;
+static __thread ObjectPool result_pool;
+
 
 /* ########## Structs implementation ########## */
 
@@ -21,7 +28,7 @@
   @return: Message object (heap allocation)
 */
 Message create_message(uint32_t size, unsigned char *payload) {
-  Message res = malloc_aligned(sizeof(*res));
+  Message res = pool_alloc(&message_pool, sizeof(*res));
 
   res->size = size;
   res->payload = payload;
@@ -51,7 +58,7 @@ void destroy_message(Message m) {
     free(m->payload);
   }
 
-  free(m);
+  pool_free(&message_pool, m);
 }
 
 
@@ -118,7 +125,7 @@ uint8_t result_code_to_u8(ResultCode code) {
   @return: ResultMessage object (heap allocation)
 */
 ResultMessage create_result_message(ResultCode code, Message m) {
-  ResultMessage res = malloc_aligned(sizeof(*res));
+  ResultMessage res = pool_alloc(&result_pool, sizeof(*res));
 
   res->code = code;
   res->message = m;
@@ -146,7 +153,7 @@ void print_result_message_debug(ResultMessage m) {
 */
 void destroy_result_message(ResultMessage m) {
   destroy_message(m->message);
-  free(m);
+  pool_free(&result_pool, m);
 }
 
 
@@ -187,7 +194,7 @@ uint8_t command_code_to_u8(CommandCode code){
 */
 
 CommandMessage create_command_message(CommandCode code, Message m) {
-  CommandMessage res = malloc_aligned(sizeof(*res));
+  CommandMessage res = pool_alloc(&command_pool, sizeof(*res));
 
   res->code = code;
   res->message = m;
@@ -216,7 +223,7 @@ void print_command_message_debug(CommandMessage m) {
 */
 void destroy_command_message(CommandMessage m) {
   destroy_message(m->message);
-  free(m);
+  pool_free(&command_pool, m);
 }
 
 
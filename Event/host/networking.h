@@ -59,6 +59,10 @@ typedef enum {
     CommandCode_ModuleOutput,
     CommandCode_Ping,
     CommandCode_RegisterEntrypoint,
+    CommandCode_RemoteOutputBatch,
+    CommandCode_Stats,
+    CommandCode_QuerySM,
+    CommandCode_LoadCachedSM,
     CommandCode_Invalid
 } CommandCode;
 
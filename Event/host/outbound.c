@@ -0,0 +1,583 @@
+#include "outbound.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "event_loop.h"
+#include "utils.h"
+#include "stats.h"
+
+#define OUTBOUND_BUCKETS 64
+#define MAX_IOV          64
+
+// [code u8 - len u16 - count u16] then per output
+// [to_sm u16 - conn_id u16 - size u16 - cipher - tag]
+#define BATCH_HEADER     5
+#define RECORD_HEADER    6
+#define TAG_SIZE         16
+#define MAX_FRAME        (3 + 0xFFFF)
+
+// Outputs to a peer beyond this many bytes waiting to be written or acked
+// are dropped. A stalled peer would otherwise grow the queues forever
+#define OUTBOUND_QUEUE_MAX (4 * 1024 * 1024)
+
+// Every worker thread keeps its own pool, its sockets are watched by the
+// worker's event loop and need no locking
+static __thread Outbound *outbound_table[OUTBOUND_BUCKETS];
+
+// Peers running an event manager without RemoteOutputBatch answer nothing
+// to it, which would shift every later ack: off unless all peers know it
+static int batch_outputs;
+
+static void outbound_event(void *arg, uint32_t events);
+
+
+static unsigned int outbound_hash(ipv4_addr_t *address, uint16_t port) {
+  uint32_t h = address->u32.u32 * 2654435761u ^ port;
+
+  return (h ^ (h >> 16)) % OUTBOUND_BUCKETS;
+}
+
+
+/*
+  Get the pooled connection to a peer, creating the entry if needed.
+  The socket itself is only opened when something is sent
+
+  @address: peer address
+  @port: peer port, host byte order
+
+  @return: pool entry, NULL if OOM
+*/
+Outbound *outbound_get(ipv4_addr_t *address, uint16_t port) {
+  unsigned int bucket = outbound_hash(address, port);
+  Outbound *peer;
+
+  for(peer = outbound_table[bucket]; peer != NULL; peer = peer->next) {
+    if(ipv4_addr_equal(&peer->address, address) && peer->port == port)
+      return peer;
+  }
+
+  peer = malloc_aligned(sizeof(Outbound));
+  if(peer == NULL)
+    return NULL;
+
+  memset(peer, 0, sizeof(Outbound));
+  peer->address = *address;
+  peer->port = port;
+  peer->fd = -1;
+  peer->next = outbound_table[bucket];
+  outbound_table[bucket] = peer;
+  return peer;
+}
+
+
+// Failures are only known once the peer answers (or the connection
+// breaks), long after the TA call that produced the output returned
+static void report_failure(PendingOutput *out, ResultCode code) {
+  if(out->count > 1)
+    fprintf(stderr, "remote output batch of %d starting on connection %d failed: %d\n",
+                out->count, out->conn_id, code);
+  else
+    fprintf(stderr, "remote output on connection %d failed: %d\n",
+                out->conn_id, code);
+}
+
+
+static void pending_output_free(Outbound *peer, PendingOutput *out) {
+  peer->queued -= out->len;
+  free(out->frame);
+  free(out);
+}
+
+
+// Fails and frees a whole queue
+static void fail_queue(Outbound *peer, PendingOutput *out) {
+  while(out != NULL) {
+    PendingOutput *next = out->next;
+
+    report_failure(out, ResultCode_InternalError);
+    pending_output_free(peer, out);
+    out = next;
+  }
+}
+
+
+static int outbound_connect(Outbound *peer);
+
+/*
+  Drop a broken connection. The outputs that were (partially) written are
+  lost. The ones never written are sent over a new connection if retry is
+  set, failed otherwise
+*/
+static void outbound_reset(Outbound *peer, int retry) {
+  EventLoop *loop = event_loop_current();
+
+  if(peer->fd >= 0) {
+    event_loop_unwatch(loop, peer->fd);
+    close(peer->fd);
+    peer->fd = -1;
+  }
+  peer->connecting = 0;
+
+  fail_queue(peer, peer->ack_head);
+  peer->ack_head = peer->ack_tail = NULL;
+  peer->result_read = 0;
+  peer->result_skip = 0;
+
+  if(peer->send_head != NULL && peer->send_offset > 0) {
+    PendingOutput *partial = peer->send_head;
+
+    peer->send_head = partial->next;
+    if(peer->send_head == NULL)
+      peer->send_tail = NULL;
+
+    report_failure(partial, ResultCode_InternalError);
+    pending_output_free(peer, partial);
+  }
+  peer->send_offset = 0;
+
+  if(peer->send_head != NULL && !(retry && outbound_connect(peer))) {
+    fail_queue(peer, peer->send_head);
+    peer->send_head = peer->send_tail = NULL;
+  }
+}
+
+
+/*
+  Start a non-blocking connect and watch the socket in the current loop.
+  Queued outputs are written once the connection is established
+
+  @return: 1 on success (possibly still in progress), 0 on error
+*/
+static int outbound_connect(Outbound *peer) {
+  EventLoop *loop = event_loop_current();
+  struct sockaddr_in servaddr;
+  int one = 1;
+  char loopback[16] = "127.0.0.1";
+  char ip[16] = {0};
+
+  if(loop == NULL)
+    return 0;
+
+  sprintf(ip, "%d.%d.%d.%d", peer->address.u8[0], peer->address.u8[1],
+              peer->address.u8[2], peer->address.u8[3]);
+
+  if(strcmp(ip, loopback) == 0){
+      sprintf(ip, "%d.%d.%d.%d", 10, 0, 2, 2); //10.0.2.2 --> QEMU gateway IP address
+  }
+
+  peer->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(peer->fd < 0) {
+    perror("socket");
+    return 0;
+  }
+
+  // frames are small and must not wait for the next one
+  setsockopt(peer->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  bzero(&servaddr, sizeof(servaddr));
+  servaddr.sin_family = AF_INET;
+  servaddr.sin_addr.s_addr = inet_addr(ip);
+  servaddr.sin_port = htons(peer->port);
+
+  peer->connecting = 0;
+  if(connect(peer->fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0) {
+    if(errno != EINPROGRESS) {
+      fprintf(stderr, "connection with %s:%d failed: %s\n", ip, peer->port,
+                  strerror(errno));
+      close(peer->fd);
+      peer->fd = -1;
+      return 0;
+    }
+    peer->connecting = 1;
+  }
+
+  if(!event_loop_watch(loop, peer->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP,
+                          outbound_event, peer)) {
+    close(peer->fd);
+    peer->fd = -1;
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+  Write the queued outputs without blocking. Fully written outputs move to
+  the ack queue
+
+  @return: 0 if the connection broke, 1 otherwise
+*/
+static int outbound_flush(Outbound *peer) {
+  while(peer->send_head != NULL) {
+    struct iovec iov[MAX_IOV];
+    int iovcnt = 0;
+
+    for(PendingOutput *out = peer->send_head; out != NULL && iovcnt < MAX_IOV;
+          out = out->next) {
+      iov[iovcnt].iov_base = out->frame;
+      iov[iovcnt].iov_len = out->len;
+      iovcnt++;
+    }
+    iov[0].iov_base = (unsigned char *) iov[0].iov_base + peer->send_offset;
+    iov[0].iov_len -= peer->send_offset;
+
+    ssize_t n = writev(peer->fd, iov, iovcnt);
+
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+      return 0;
+    }
+
+    size_t sent = peer->send_offset + n;
+    while(peer->send_head != NULL && sent >= peer->send_head->len) {
+      PendingOutput *out = peer->send_head;
+
+      sent -= out->len;
+      peer->send_head = out->next;
+      if(peer->send_head == NULL)
+        peer->send_tail = NULL;
+
+      out->next = NULL;
+      if(peer->ack_tail != NULL)
+        peer->ack_tail->next = out;
+      else
+        peer->ack_head = out;
+      peer->ack_tail = out;
+    }
+    peer->send_offset = sent;
+  }
+
+  return 1;
+}
+
+
+// A complete result arrived: it belongs to the oldest unacknowledged output
+static void outbound_ack(Outbound *peer, ResultCode code) {
+  PendingOutput *out = peer->ack_head;
+
+  if(out == NULL)
+    return;
+
+  peer->ack_head = out->next;
+  if(peer->ack_head == NULL)
+    peer->ack_tail = NULL;
+
+  if(code != ResultCode_Ok)
+    report_failure(out, code);
+
+  pending_output_free(peer, out);
+}
+
+
+/*
+  Read the results sent back by the peer, [code u8 - len u16 - payload]
+
+  @return: 0 if the connection broke, 1 otherwise
+*/
+static int outbound_read_results(Outbound *peer) {
+  unsigned char buf[512];
+
+  while(1) {
+    ssize_t n = recv(peer->fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 1;
+    if(n <= 0)
+      return 0;
+
+    for(ssize_t i = 0; i < n; ) {
+      if(peer->result_read < 3) {
+        peer->result[peer->result_read++] = buf[i++];
+
+        if(peer->result_read == 3) {
+          uint16_t size;
+          memcpy(&size, peer->result + 1, 2);
+          peer->result_skip = ntohs(size);
+        }
+      }
+      else {
+        size_t skip = n - i < peer->result_skip ? n - i : peer->result_skip;
+        i += skip;
+        peer->result_skip -= skip;
+      }
+
+      if(peer->result_read == 3 && peer->result_skip == 0) {
+        outbound_ack(peer, u8_to_result_code(peer->result[0]));
+        peer->result_read = 0;
+      }
+    }
+  }
+}
+
+
+static void outbound_event(void *arg, uint32_t events) {
+  Outbound *peer = arg;
+
+  if(peer->connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if(!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+      return;
+
+    getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if(err != 0) {
+      fprintf(stderr, "connection with port %d failed: %s\n", peer->port,
+                  strerror(err));
+      outbound_reset(peer, 0);
+      return;
+    }
+    peer->connecting = 0;
+  }
+
+  if((events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) &&
+        !outbound_read_results(peer)) {
+    outbound_reset(peer, 1);
+    return;
+  }
+
+  if(!outbound_flush(peer))
+    outbound_reset(peer, 1);
+}
+
+
+/*
+  Queue a frame for a peer and return without waiting for its result.
+  The connection is opened on first use and kept open; if it breaks (e.g.
+  the peer restarted) the outputs not written yet go over a new one
+
+  @peer: pool entry from outbound_get
+  @frame: complete frame [command u8 - len u16 - payload], heap allocated,
+          the pool takes ownership of it
+  @len: size of frame
+  @conn_id: first connection the frame carries an output for
+  @count: number of outputs in the frame
+*/
+static void outbound_queue(Outbound *peer, unsigned char *frame, size_t len,
+                    uint16_t conn_id, uint16_t count) {
+  PendingOutput *out = malloc_aligned(sizeof(PendingOutput));
+
+  if(out == NULL) {
+    free(frame);
+    return;
+  }
+
+  out->frame = frame;
+  out->len = len;
+  out->conn_id = conn_id;
+  out->count = count;
+  out->next = NULL;
+  peer->queued += len;
+
+  if(peer->send_tail != NULL)
+    peer->send_tail->next = out;
+  else
+    peer->send_head = out;
+  peer->send_tail = out;
+
+  if(peer->fd < 0) {
+    if(!outbound_connect(peer)) {
+      fail_queue(peer, peer->send_head);
+      peer->send_head = peer->send_tail = NULL;
+    }
+    return;
+  }
+
+  if(!peer->connecting && !outbound_flush(peer))
+    outbound_reset(peer, 1);
+}
+
+
+/*
+  Finish the batch being filled and queue it. A batch holding a single
+  output goes out as a plain RemoteOutput frame
+*/
+static void outbound_close_batch(Outbound *peer) {
+  unsigned char *frame = peer->batch;
+  size_t len = peer->batch_len;
+  uint16_t htons_val;
+
+  if(frame == NULL)
+    return;
+
+  if(peer->batch_count == 1) {
+    // [to_sm - conn_id] and [cipher - tag] without count and size
+    memmove(frame + 3, frame + BATCH_HEADER, 4);
+    memmove(frame + 7, frame + BATCH_HEADER + RECORD_HEADER,
+                len - BATCH_HEADER - RECORD_HEADER);
+    len -= 4;
+    frame[0] = command_code_to_u8(CommandCode_RemoteOutput);
+  }
+  else {
+    frame[0] = command_code_to_u8(CommandCode_RemoteOutputBatch);
+    htons_val = htons(peer->batch_count);
+    memcpy(frame + 3, &htons_val, 2);
+  }
+
+  htons_val = htons(len - 3);
+  memcpy(frame + 1, &htons_val, 2);
+
+  outbound_queue(peer, frame, len, peer->batch_conn_id, peer->batch_count);
+
+  peer->batch = NULL;
+  peer->batch_len = 0;
+  peer->batch_cap = 0;
+  peer->batch_count = 0;
+}
+
+
+// Deferred to the end of the loop iteration in which the batch was opened
+static void outbound_flush_batch(void *arg) {
+  Outbound *peer = arg;
+  uint64_t start = stats_now();
+
+  peer->flush_pending = 0;
+  outbound_close_batch(peer);
+  stats_record(Stage_RemoteSend, start);
+}
+
+
+/*
+  Choose how outputs are sent to the peers, before the workers start
+
+  @enabled: coalesce them into RemoteOutputBatch frames, otherwise send a
+            RemoteOutput frame each
+*/
+void outbound_set_batching(int enabled) {
+  batch_outputs = enabled;
+}
+
+
+// Queue an output as a RemoteOutput frame of its own
+static void outbound_send_single(Outbound *peer, uint16_t to_sm, uint16_t conn_id,
+                    unsigned char *encrypt, uint32_t size, unsigned char *tag) {
+  size_t len = 3 + 4 + size + TAG_SIZE;
+  uint64_t start = stats_now();
+  uint16_t htons_val;
+
+  unsigned char *frame = malloc_aligned(len);
+  if(frame == NULL) {
+    fprintf(stderr, "no memory for output on connection %d\n", conn_id);
+    return;
+  }
+
+  frame[0] = command_code_to_u8(CommandCode_RemoteOutput);
+  htons_val = htons(len - 3);
+  memcpy(frame + 1, &htons_val, 2);
+  htons_val = htons(to_sm);
+  memcpy(frame + 3, &htons_val, 2);
+  htons_val = htons(conn_id);
+  memcpy(frame + 5, &htons_val, 2);
+  memcpy(frame + 7, encrypt, size);
+  memcpy(frame + 7 + size, tag, TAG_SIZE);
+
+  outbound_queue(peer, frame, len, conn_id, 1);
+  stats_record(Stage_RemoteSend, start);
+}
+
+
+/*
+  Send an output of a module to the peer. With batching on, outputs to the
+  same peer produced while the loop handles the current events (e.g. the
+  fan-out of one TA call) are coalesced into a single RemoteOutputBatch
+  frame, flushed before the loop waits again
+
+  @peer: pool entry from outbound_get
+  @to_sm: destination module
+  @conn_id: connection
+  @encrypt: cipher text, copied
+  @size: size of encrypt
+  @tag: 16-byte tag, copied
+*/
+void outbound_send_output(Outbound *peer, uint16_t to_sm, uint16_t conn_id,
+                    unsigned char *encrypt, uint32_t size, unsigned char *tag) {
+  size_t record_len = RECORD_HEADER + size + TAG_SIZE;
+  uint16_t htons_val;
+
+  if(BATCH_HEADER + record_len > MAX_FRAME) {
+    fprintf(stderr, "output on connection %d too large: %d\n", conn_id, size);
+    return;
+  }
+
+  // the batch being filled counts, it is queued before the loop waits
+  if(peer->queued + peer->batch_len + record_len > OUTBOUND_QUEUE_MAX) {
+    fprintf(stderr, "queue to port %d full, output on connection %d dropped\n",
+                peer->port, conn_id);
+    return;
+  }
+
+  if(!batch_outputs) {
+    outbound_send_single(peer, to_sm, conn_id, encrypt, size, tag);
+    return;
+  }
+
+  if(peer->batch != NULL && peer->batch_len + record_len > MAX_FRAME)
+    outbound_close_batch(peer);
+
+  if(peer->batch == NULL) {
+    peer->batch_len = BATCH_HEADER;
+    peer->batch_cap = 0;
+    peer->batch_count = 0;
+    peer->batch_conn_id = conn_id;
+  }
+
+  if(peer->batch_len + record_len > peer->batch_cap) {
+    size_t cap = peer->batch_cap == 0 ? 256 : peer->batch_cap;
+
+    while(cap < peer->batch_len + record_len)
+      cap *= 2;
+    if(cap > MAX_FRAME)
+      cap = MAX_FRAME;
+
+    unsigned char *batch = realloc(peer->batch, cap);
+    if(batch == NULL) {
+      fprintf(stderr, "no memory for output on connection %d\n", conn_id);
+      return;
+    }
+
+    peer->batch = batch;
+    peer->batch_cap = cap;
+  }
+
+  unsigned char *record = peer->batch + peer->batch_len;
+
+  htons_val = htons(to_sm);
+  memcpy(record, &htons_val, 2);
+  htons_val = htons(conn_id);
+  memcpy(record + 2, &htons_val, 2);
+  htons_val = htons(size);
+  memcpy(record + 4, &htons_val, 2);
+  memcpy(record + RECORD_HEADER, encrypt, size);
+  memcpy(record + RECORD_HEADER + size, tag, TAG_SIZE);
+
+  peer->batch_len += record_len;
+  peer->batch_count++;
+
+  if(!peer->flush_pending) {
+    EventLoop *loop = event_loop_current();
+
+    // outside of a loop there is nothing to coalesce with
+    if(loop == NULL || !event_loop_defer(loop, outbound_flush_batch, peer)) {
+      outbound_close_batch(peer);
+      return;
+    }
+    peer->flush_pending = 1;
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef __OUTBOUND_H__
+#define __OUTBOUND_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "addr.h"
+#include "networking.h"
+
+// A RemoteOutput frame queued for a peer, or sent and waiting for its ack
+typedef struct pending_output {
+  unsigned char *frame;
+  size_t len;
+  uint16_t conn_id;             // for error reports (first one of a batch)
+  uint16_t count;               // outputs carried by the frame
+  struct pending_output *next;
+} PendingOutput;
+
+// Long-lived connection to a peer event manager, keyed by (address, port).
+// Frames are pipelined: they are written as soon as the socket accepts them
+// and the peer's results are matched to them in order
+typedef struct outbound {
+  ipv4_addr_t address;
+  uint16_t port;
+  int fd;                       // -1 while not connected
+  int connecting;
+
+  PendingOutput *send_head;     // not (fully) written yet
+  PendingOutput *send_tail;
+  size_t send_offset;           // bytes of send_head already written
+  PendingOutput *ack_head;      // written, waiting for the peer's result
+  PendingOutput *ack_tail;
+  size_t queued;                // bytes of the frames in both queues
+
+  unsigned char result[3];      // [code u8 - len u16] being received
+  size_t result_read;
+  uint16_t result_skip;         // result payload bytes left to discard
+
+  unsigned char *batch;         // RemoteOutputBatch frame being filled
+  size_t batch_len;
+  size_t batch_cap;
+  uint16_t batch_count;
+  uint16_t batch_conn_id;
+  int flush_pending;            // batch flush deferred to the end of the
+                                // current loop iteration
+
+  struct outbound *next;        // bucket chain
+} Outbound;
+
+void outbound_set_batching(int enabled);
+Outbound *outbound_get(ipv4_addr_t *address, uint16_t port);
+void outbound_send_output(Outbound *peer, uint16_t to_sm, uint16_t conn_id,
+                    unsigned char *encrypt, uint32_t size, unsigned char *tag);
+
+#endif
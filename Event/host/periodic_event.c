@@ -0,0 +1,334 @@
+#include "periodic_event.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event_loop.h"
+#include "enclave_utils.h"
+#include "utils.h"
+
+// Hierarchical timer wheel with a 1 ms tick: level n has WHEEL_SLOTS slots
+// of WHEEL_SLOTS^n ticks each, 4 levels cover about 4.6 hours. A timer due
+// later waits in the last level and is put back until it is due
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_LEVELS  4
+#define WHEEL_RANGE   ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+// Entrypoints called per loop iteration, before the sockets are polled again
+#define PERIODIC_FIRE_BATCH 64
+
+typedef struct periodic_timer {
+  struct periodic_timer *next;      // in its slot
+  struct periodic_timer *due_next;
+  uint64_t expires;                 // tick
+  PeriodicEvent event;
+  int pending;                      // waiting in the due list
+} PeriodicTimer;
+
+typedef struct timer_wheel {
+  PeriodicTimer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint64_t occupied[WHEEL_LEVELS];  // bitmap of the non-empty slots
+  uint64_t tick;                    // last tick handled
+  size_t count;
+} TimerWheel;
+
+// Every worker runs the events registered through its own connections
+static __thread TimerWheel wheel;
+static __thread int timer_fd = -1;
+static __thread uint64_t start_ms;
+static __thread PeriodicTimer *due_head;
+static __thread PeriodicTimer *due_tail;
+static __thread int fire_scheduled;
+
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+  Put a timer in the slot it is taken out of when it is due, or when it must
+  go down a level. The slots are used circularly: a timer lands in the
+  current slot of a level only if it is due a full turn of it later
+
+  @timer: expires is after the current tick
+*/
+static void wheel_insert(PeriodicTimer *timer) {
+  uint64_t expires = timer->expires;
+  unsigned int level = 0;
+
+  if(expires - wheel.tick >= WHEEL_RANGE)
+    expires = wheel.tick + WHEEL_RANGE - 1;
+
+  while(level < WHEEL_LEVELS - 1 &&
+          expires - wheel.tick >= (uint64_t) 1 << (WHEEL_BITS * (level + 1)))
+    level++;
+
+  unsigned int slot = (expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+
+  timer->next = wheel.slots[level][slot];
+  wheel.slots[level][slot] = timer;
+  wheel.occupied[level] |= (uint64_t) 1 << slot;
+}
+
+
+static PeriodicTimer *wheel_take_slot(unsigned int level, unsigned int slot) {
+  PeriodicTimer *list = wheel.slots[level][slot];
+
+  wheel.slots[level][slot] = NULL;
+  wheel.occupied[level] &= ~((uint64_t) 1 << slot);
+  return list;
+}
+
+
+/*
+  Find the first tick after the current one when a slot has to be handled,
+  in constant time: per level, the occupied slots are searched from the one
+  after the current slot, wrapping around
+
+  @return: the tick, 0 if the wheel is empty
+*/
+static uint64_t wheel_next(void) {
+  uint64_t next = 0;
+
+  for(unsigned int level = 0; level < WHEEL_LEVELS; level++) {
+    uint64_t bits = wheel.occupied[level];
+
+    if(bits == 0)
+      continue;
+
+    unsigned int shift = WHEEL_BITS * level;
+    uint64_t unit = wheel.tick >> shift;
+    unsigned int from = (unit + 1) & (WHEEL_SLOTS - 1);
+    uint64_t rotated = from == 0 ? bits : (bits >> from) | (bits << (64 - from));
+    uint64_t at = (unit + 1 + __builtin_ctzll(rotated)) << shift;
+
+    if(next == 0 || at < next)
+      next = at;
+  }
+
+  return next;
+}
+
+
+static void due_push(PeriodicTimer *timer) {
+  // a call not made yet is not made twice
+  if(timer->pending)
+    return;
+
+  timer->pending = 1;
+  timer->due_next = NULL;
+  if(due_tail == NULL)
+    due_head = timer;
+  else
+    due_tail->due_next = timer;
+  due_tail = timer;
+}
+
+
+/*
+  Handle a timer taken out of the wheel at the current tick: call it if it
+  is due and schedule its next call. Calls missed meanwhile are skipped, the
+  timer keeps its phase
+*/
+static void wheel_expire(PeriodicTimer *timer) {
+  uint64_t period = timer->event.frequency;
+
+  if(timer->expires <= wheel.tick) {
+    due_push(timer);
+    timer->expires += period * ((wheel.tick - timer->expires) / period + 1);
+  }
+
+  wheel_insert(timer);
+}
+
+
+/*
+  Handle the slots of a tick: the current slot of a level is taken down when
+  the lower levels start a new turn, the timers of level 0 are due
+*/
+static void wheel_process(uint64_t tick) {
+  PeriodicTimer *timer, *next;
+
+  wheel.tick = tick;
+
+  for(unsigned int level = 1; level < WHEEL_LEVELS; level++) {
+    unsigned int shift = WHEEL_BITS * level;
+
+    if((tick & (((uint64_t) 1 << shift) - 1)) != 0)
+      break;
+
+    for(timer = wheel_take_slot(level, (tick >> shift) & (WHEEL_SLOTS - 1));
+          timer != NULL; timer = next) {
+      next = timer->next;
+      wheel_expire(timer);
+    }
+  }
+
+  for(timer = wheel_take_slot(0, tick & (WHEEL_SLOTS - 1)); timer != NULL;
+        timer = next) {
+    next = timer->next;
+    wheel_expire(timer);
+  }
+}
+
+
+// Move the wheel to tick, going straight to the ticks that have slots to handle
+static void wheel_advance(uint64_t tick) {
+  uint64_t next;
+
+  while(wheel.count > 0 && (next = wheel_next()) != 0 && next <= tick)
+    wheel_process(next);
+
+  if(tick > wheel.tick)
+    wheel.tick = tick;
+}
+
+
+// Arm the timerfd for the next tick to handle, or disarm it
+static void timer_arm(void) {
+  struct itimerspec its;
+  uint64_t next = wheel_next();
+
+  memset(&its, 0, sizeof(its));
+
+  if(next != 0) {
+    uint64_t at = start_ms + next;
+
+    its.it_value.tv_sec = at / 1000;
+    its.it_value.tv_nsec = (at % 1000) * 1000000;
+  }
+
+  if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    perror("timerfd_settime");
+}
+
+
+static void periodic_event_schedule(void);
+
+
+// Call the due entrypoints, the rest waits for the next loop iteration
+static void periodic_event_fire(void *arg) {
+  (void) arg;
+
+  fire_scheduled = 0;
+
+  for(int i = 0; i < PERIODIC_FIRE_BATCH && due_head != NULL; i++) {
+    PeriodicTimer *timer = due_head;
+    unsigned char buf[4];
+
+    due_head = timer->due_next;
+    if(due_head == NULL)
+      due_tail = NULL;
+    timer->pending = 0;
+
+    // as a CallEntrypoint payload without data
+    buf[0] = timer->event.module >> 8;
+    buf[1] = timer->event.module & 0xFF;
+    buf[2] = timer->event.entry >> 8;
+    buf[3] = timer->event.entry & 0xFF;
+
+    // the module may not be loaded yet, the timer is kept
+    destroy_result_message(handle_user_entrypoint(buf, 0, timer->event.module));
+  }
+
+  if(due_head != NULL)
+    periodic_event_schedule();
+}
+
+
+static void periodic_event_schedule(void) {
+  EventLoop *loop = event_loop_current();
+
+  if(!fire_scheduled && loop != NULL &&
+      event_loop_post(loop, periodic_event_fire, NULL))
+    fire_scheduled = 1;
+}
+
+
+static void periodic_event_tick(void *arg, uint32_t events) {
+  uint64_t expirations;
+  ssize_t ret;
+  (void) arg;
+  (void) events;
+
+  // edge triggered, a single read resets the counter
+  ret = read(timer_fd, &expirations, sizeof(expirations));
+  (void) ret;
+
+  wheel_advance(now_ms() - start_ms);
+  timer_arm();
+
+  if(due_head != NULL)
+    periodic_event_schedule();
+}
+
+
+// Create the timerfd of the worker on its first event
+static int periodic_event_init(EventLoop *loop) {
+  if(timer_fd >= 0)
+    return 1;
+
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(timer_fd < 0) {
+    perror("timerfd_create");
+    return 0;
+  }
+
+  if(!event_loop_watch(loop, timer_fd, EPOLLIN, periodic_event_tick, NULL)) {
+    close(timer_fd);
+    timer_fd = -1;
+    return 0;
+  }
+
+  // tick 0 is reserved: wheel_next returns it for an empty wheel
+  start_ms = now_ms() - 1;
+  wheel.tick = 1;
+  return 1;
+}
+
+
+/*
+  Call an entrypoint of a module periodically, from the worker running this
+  call. The first call is made one period from now. Adding a timer and
+  handling a due one take constant time, whatever the number of timers
+
+  @event: module, entrypoint and period in milliseconds, copied
+
+  @return: 1 on success, 0 if the event cannot be scheduled
+*/
+int periodic_event_add(const PeriodicEvent *event) {
+  EventLoop *loop = event_loop_current();
+  PeriodicTimer *timer;
+
+  if(loop == NULL || event->frequency == 0 || !periodic_event_init(loop))
+    return 0;
+
+  timer = malloc_aligned(sizeof(PeriodicTimer));
+  if(timer == NULL)
+    return 0;
+
+  // the timers due before now are handled first, they keep the wheel tick
+  // in step with the clock
+  wheel_advance(now_ms() - start_ms);
+  if(due_head != NULL)
+    periodic_event_schedule();
+
+  timer->event = *event;
+  timer->pending = 0;
+  timer->expires = wheel.tick + event->frequency;
+  wheel_insert(timer);
+  wheel.count++;
+
+  timer_arm();
+  return 1;
+}
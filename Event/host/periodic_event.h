@@ -0,0 +1,15 @@
+#ifndef __PERIODIC_EVENT_H__
+#define __PERIODIC_EVENT_H__
+
+#include <stdint.h>
+
+// Entrypoint of a module called every frequency milliseconds, with no data
+typedef struct periodic_event {
+  uint16_t module;
+  uint16_t entry;
+  uint32_t frequency;
+} PeriodicEvent;
+
+int periodic_event_add(const PeriodicEvent *event);
+
+#endif
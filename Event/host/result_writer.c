@@ -0,0 +1,200 @@
+#include "result_writer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+#define INITIAL_QUEUE 16
+#define MAX_IOV       64   // two iovecs per response
+
+
+void result_writer_init(ResultWriter *w) {
+  w->queue = NULL;
+  w->cap = 0;
+  w->head = 0;
+  w->count = 0;
+  w->offset = 0;
+  w->first_slot = 0;
+}
+
+
+// Drops the responses that could not be delivered
+void result_writer_destroy(ResultWriter *w) {
+  for(size_t i = 0; i < w->count; i++) {
+    ResultMessage res = w->queue[(w->head + i) % w->cap].res;
+
+    if(res != NULL)
+      destroy_result_message(res);
+  }
+
+  free(w->queue);
+  result_writer_init(w);
+}
+
+
+size_t result_writer_pending(const ResultWriter *w) {
+  return w->count;
+}
+
+
+static int result_writer_grow(ResultWriter *w) {
+  size_t cap = w->cap == 0 ? INITIAL_QUEUE : w->cap * 2;
+  PendingResult *queue = malloc(cap * sizeof(PendingResult));
+
+  if(queue == NULL)
+    return 0;
+
+  // unwrap the circular queue at the start of the new storage
+  for(size_t i = 0; i < w->count; i++)
+    queue[i] = w->queue[(w->head + i) % w->cap];
+
+  free(w->queue);
+  w->queue = queue;
+  w->cap = cap;
+  w->head = 0;
+  return 1;
+}
+
+
+/*
+  Queue a response. Nothing is written until result_writer_flush
+
+  @w: writer
+  @res: response, the writer takes ownership of it
+
+  @return: 1 on success, 0 on OOM (res is destroyed)
+*/
+int result_writer_push(ResultWriter *w, ResultMessage res) {
+  if(w->count == w->cap && !result_writer_grow(w)) {
+    destroy_result_message(res);
+    return 0;
+  }
+
+  PendingResult *p = &w->queue[(w->head + w->count) % w->cap];
+  uint16_t htons_size = htons(res->message->size);
+
+  p->header[0] = result_code_to_u8(res->code);
+  memcpy(p->header + 1, &htons_size, 2);
+  p->res = res;
+  w->count++;
+  return 1;
+}
+
+
+/*
+  Keep the place of a response that is not known yet, e.g. the result of a
+  command handled by another thread. The responses after it are held back
+  until it is filled
+
+  @w: writer
+  @slot: set to the number of the response
+
+  @return: 1 on success, 0 on OOM
+*/
+int result_writer_reserve(ResultWriter *w, size_t *slot) {
+  if(w->count == w->cap && !result_writer_grow(w))
+    return 0;
+
+  w->queue[(w->head + w->count) % w->cap].res = NULL;
+  *slot = w->first_slot + w->count;
+  w->count++;
+  return 1;
+}
+
+
+// Set a reserved response, the writer takes ownership of res
+void result_writer_fill(ResultWriter *w, size_t slot, ResultMessage res) {
+  PendingResult *p = &w->queue[(w->head + (slot - w->first_slot)) % w->cap];
+  uint16_t htons_size = htons(res->message->size);
+
+  p->header[0] = result_code_to_u8(res->code);
+  memcpy(p->header + 1, &htons_size, 2);
+  p->res = res;
+}
+
+
+/*
+  Write as many queued responses as the socket accepts, with scatter-gather
+  I/O and without copying the payloads. A partially written response is
+  resumed on the next call
+
+  @w: writer
+  @sd: non-blocking socket
+
+  @return: 1 if the queue is empty, 0 if the socket is full (wait for
+           EPOLLOUT), 2 if the next response is reserved and not filled yet,
+           -1 on error
+*/
+int result_writer_flush(ResultWriter *w, int sd) {
+  while(w->count > 0) {
+    struct iovec iov[MAX_IOV];
+    int iovcnt = 0;
+    size_t skip = w->offset;
+
+    if(w->queue[w->head].res == NULL)
+      return 2;
+
+    for(size_t i = 0; i < w->count && iovcnt + 2 <= MAX_IOV; i++) {
+      PendingResult *p = &w->queue[(w->head + i) % w->cap];
+
+      if(p->res == NULL)
+        break;
+
+      Message msg = p->res->message;
+
+      iov[iovcnt].iov_base = p->header;
+      iov[iovcnt].iov_len = sizeof(p->header);
+      iovcnt++;
+
+      if(msg->size > 0) {
+        iov[iovcnt].iov_base = msg->payload;
+        iov[iovcnt].iov_len = msg->size;
+        iovcnt++;
+      }
+    }
+
+    // skip what was already sent of the oldest response
+    int first = 0;
+    while(skip >= iov[first].iov_len) {
+      skip -= iov[first].iov_len;
+      first++;
+    }
+    iov[first].iov_base = (unsigned char *) iov[first].iov_base + skip;
+    iov[first].iov_len -= skip;
+
+    ssize_t n = writev(sd, iov + first, iovcnt - first);
+
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+
+    // retire the responses that are fully on the wire
+    size_t sent = w->offset + n;
+    while(w->count > 0) {
+      PendingResult *p = &w->queue[w->head];
+
+      if(p->res == NULL)
+        break;
+
+      size_t len = sizeof(p->header) + p->res->message->size;
+
+      if(sent < len)
+        break;
+
+      sent -= len;
+      destroy_result_message(p->res);
+      w->head = (w->head + 1) % w->cap;
+      w->count--;
+      w->first_slot++;
+    }
+    w->offset = sent;
+  }
+
+  return 1;
+}
@@ -0,0 +1,35 @@
+#ifndef __RESULT_WRITER_H__
+#define __RESULT_WRITER_H__
+
+#include <stddef.h>
+
+#include "networking.h"
+
+// A response waiting to be sent. Only the [code u8 - len u16] header is
+// serialized, the payload is sent straight from the ResultMessage. res is
+// NULL while a reserved response is not known yet
+typedef struct pending_result {
+  unsigned char header[3];
+  ResultMessage res;
+} PendingResult;
+
+// Per-socket queue of responses, in the order the commands were received
+typedef struct result_writer {
+  PendingResult *queue;   // circular, grown on demand
+  size_t cap;
+  size_t head;
+  size_t count;
+  size_t offset;          // bytes of the oldest response already sent
+  size_t first_slot;      // slot number of the oldest response
+} ResultWriter;
+
+void result_writer_init(ResultWriter *w);
+void result_writer_destroy(ResultWriter *w);
+
+size_t result_writer_pending(const ResultWriter *w);
+int result_writer_push(ResultWriter *w, ResultMessage res);
+int result_writer_reserve(ResultWriter *w, size_t *slot);
+void result_writer_fill(ResultWriter *w, size_t slot, ResultMessage res);
+int result_writer_flush(ResultWriter *w, int sd);
+
+#endif
@@ -0,0 +1,137 @@
+#include "ring_buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "utils.h"
+
+
+/*
+  Allocate the storage of a ring buffer
+
+  @rb: ring buffer
+  @size: capacity in bytes, must be a power of two
+
+  @return: 1 on success, 0 on OOM
+*/
+int ring_buffer_init(RingBuffer *rb, size_t size) {
+  rb->data = malloc_aligned(size);
+  rb->size = size;
+  rb->head = 0;
+  rb->tail = 0;
+
+  return rb->data != NULL;
+}
+
+
+void ring_buffer_destroy(RingBuffer *rb) {
+  free(rb->data);
+  rb->data = NULL;
+}
+
+
+size_t ring_buffer_used(const RingBuffer *rb) {
+  return rb->tail - rb->head;
+}
+
+
+size_t ring_buffer_space(const RingBuffer *rb) {
+  return rb->size - ring_buffer_used(rb);
+}
+
+
+/*
+  Fill the free space of the ring with a single non-blocking recvmsg. The
+  free space may wrap around the end of the storage, hence two segments
+
+  @rb: ring buffer
+  @fd: socket to read from
+
+  @return: as recv(). 0 if the ring is full
+*/
+ssize_t ring_buffer_recv(RingBuffer *rb, int fd) {
+  struct iovec iov[2];
+  struct msghdr msg;
+  size_t space = ring_buffer_space(rb);
+  size_t start = rb->tail & (rb->size - 1);
+  size_t first = rb->size - start;
+  ssize_t ret;
+
+  if(space == 0)
+    return 0;
+
+  if(first > space)
+    first = space;
+
+  iov[0].iov_base = rb->data + start;
+  iov[0].iov_len = first;
+  iov[1].iov_base = rb->data;
+  iov[1].iov_len = space - first;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+
+  ret = recvmsg(fd, &msg, MSG_DONTWAIT);
+  if(ret > 0)
+    rb->tail += ret;
+
+  return ret;
+}
+
+
+/*
+  Consume up to len bytes from the ring
+
+  @rb: ring buffer
+  @dst: where to copy the bytes
+  @len: maximum number of bytes to consume
+
+  @return: number of bytes consumed
+*/
+size_t ring_buffer_pop(RingBuffer *rb, void *dst, size_t len) {
+  size_t used = ring_buffer_used(rb);
+  size_t start = rb->head & (rb->size - 1);
+  size_t first;
+
+  if(len > used)
+    len = used;
+
+  first = rb->size - start;
+  if(first > len)
+    first = len;
+
+  memcpy(dst, rb->data + start, first);
+  memcpy((unsigned char *) dst + first, rb->data, len - first);
+  rb->head += len;
+
+  return len;
+}
+
+
+/*
+  Get the bytes at the head of the ring without copying them. Only those
+  before the end of the storage are returned, the rest follows once they
+  are consumed
+
+  @rb: ring buffer
+  @ptr: set to the first byte
+
+  @return: number of contiguous bytes at *ptr
+*/
+size_t ring_buffer_peek(RingBuffer *rb, unsigned char **ptr) {
+  size_t used = ring_buffer_used(rb);
+  size_t start = rb->head & (rb->size - 1);
+  size_t first = rb->size - start;
+
+  *ptr = rb->data + start;
+  return first < used ? first : used;
+}
+
+
+// Drop len bytes returned by ring_buffer_peek
+void ring_buffer_consume(RingBuffer *rb, size_t len) {
+  rb->head += len;
+}
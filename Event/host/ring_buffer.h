@@ -0,0 +1,27 @@
+#ifndef __RING_BUFFER_H__
+#define __RING_BUFFER_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Byte ring used as per-socket receive buffer. head and tail only ever grow,
+// the size must be a power of two so they can be masked
+typedef struct ring_buffer {
+  unsigned char *data;
+  size_t size;
+  size_t head;    // next byte to consume
+  size_t tail;    // next byte to fill
+} RingBuffer;
+
+int ring_buffer_init(RingBuffer *rb, size_t size);
+void ring_buffer_destroy(RingBuffer *rb);
+
+size_t ring_buffer_used(const RingBuffer *rb);
+size_t ring_buffer_space(const RingBuffer *rb);
+
+ssize_t ring_buffer_recv(RingBuffer *rb, int fd);
+size_t ring_buffer_pop(RingBuffer *rb, void *dst, size_t len);
+size_t ring_buffer_peek(RingBuffer *rb, unsigned char **ptr);
+void ring_buffer_consume(RingBuffer *rb, size_t len);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+// FIPS 180-4 SHA-256, used to recognize TA binaries already installed
+typedef struct sha256_ctx {
+  uint32_t state[8];
+  uint64_t length;              // bytes hashed so far
+  unsigned char block[64];
+  size_t block_len;
+} Sha256Ctx;
+
+void sha256_init(Sha256Ctx *ctx);
+void sha256_update(Sha256Ctx *ctx, const unsigned char *data, size_t size);
+void sha256_final(Sha256Ctx *ctx, unsigned char digest[SHA256_SIZE]);
+
+void sha256(const unsigned char *data, size_t size,
+              unsigned char digest[SHA256_SIZE]);
+
+#endif
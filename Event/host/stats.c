@@ -0,0 +1,143 @@
+#include "stats.h"
+
+#include <string.h>
+#include <time.h>
+
+/*
+  Log-linear histograms in the spirit of HdrHistogram: every power of two is
+  split in 2^SUB_BITS buckets, so a recorded value is off by at most 1/16
+  (~6%). Counters are updated with relaxed atomics, recording never blocks
+  and the workers do not share any lock
+*/
+#define SUB_BITS    4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define NUM_BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+typedef struct histogram {
+  uint64_t max;
+  uint64_t buckets[NUM_BUCKETS];
+} Histogram;
+
+static Histogram histograms[Stage_Count];
+
+// Percentiles reported by the Stats command, in thousandths
+static const unsigned int percentiles[] = { 500, 900, 990, 999 };
+#define NUM_PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+
+uint64_t stats_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static unsigned int bucket_index(uint64_t value) {
+  if(value < SUB_BUCKETS)
+    return value;
+
+  unsigned int msb = 63 - __builtin_clzll(value);
+  unsigned int shift = msb - SUB_BITS;
+
+  return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+
+// Highest value counted in a bucket
+static uint64_t bucket_value(unsigned int index) {
+  if(index < SUB_BUCKETS)
+    return index;
+
+  unsigned int shift = index / SUB_BUCKETS - 1;
+  uint64_t sub = index % SUB_BUCKETS;
+
+  return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+
+uint64_t stats_record(Stage stage, uint64_t start) {
+  Histogram *h = &histograms[stage];
+  uint64_t now = stats_now();
+  uint64_t value = now - start;
+  uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&h->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+
+  while(value > max &&
+        !__atomic_compare_exchange_n(&h->max, &max, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  return now;
+}
+
+
+static unsigned char *put_u64(unsigned char *p, uint64_t value) {
+  for(int i = 7; i >= 0; i--)
+    *p++ = value >> (8 * i);
+
+  return p;
+}
+
+
+/*
+  Write a snapshot of the histograms, for each stage:
+  [stage u8 - count u64 - p50 u64 - p90 u64 - p99 u64 - p999 u64 - max u64]
+  with the latencies in nanoseconds, big-endian. Concurrent updates may be
+  partially included
+
+  @buf: destination
+  @size: size of buf
+
+  @return: bytes written, 0 if buf is too small
+*/
+size_t stats_serialize(unsigned char *buf, size_t size) {
+  size_t record = 1 + 8 * (2 + NUM_PERCENTILES);
+  unsigned char *p = buf;
+
+  if(size < Stage_Count * record)
+    return 0;
+
+  for(int stage = 0; stage < Stage_Count; stage++) {
+    Histogram *h = &histograms[stage];
+    uint64_t count = 0;
+    uint64_t seen = 0;
+    unsigned int next = 0;
+    uint64_t values[NUM_PERCENTILES] = { 0 };
+
+    for(unsigned int i = 0; i < NUM_BUCKETS; i++)
+      count += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+
+    for(unsigned int i = 0; i < NUM_BUCKETS && next < NUM_PERCENTILES; i++) {
+      seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+
+      while(next < NUM_PERCENTILES && count > 0 &&
+            seen * 1000 >= count * percentiles[next])
+        values[next++] = bucket_value(i);
+    }
+
+    // a bucket bound may be above anything recorded
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    *p++ = stage;
+    p = put_u64(p, count);
+    for(unsigned int i = 0; i < NUM_PERCENTILES; i++)
+      p = put_u64(p, values[i] < max ? values[i] : max);
+    p = put_u64(p, max);
+  }
+
+  return p - buf;
+}
+
+
+void stats_reset(void) {
+  for(int stage = 0; stage < Stage_Count; stage++) {
+    Histogram *h = &histograms[stage];
+
+    for(unsigned int i = 0; i < NUM_BUCKETS; i++)
+      __atomic_store_n(&h->buckets[i], 0, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Stages of the handling of an event, each has its own latency histogram
+typedef enum {
+  Stage_Decode,         // frame decoding, from the receive ring to a message
+  Stage_Lookup,         // module and connection registry lookups
+  Stage_Invoke,         // TEEC_InvokeCommand
+  Stage_Demux,          // splitting the outputs of an invocation
+  Stage_RemoteSend,     // writing the outputs to a peer
+  Stage_Count
+} Stage;
+
+// Monotonic clock in nanoseconds, read through the vDSO
+uint64_t stats_now(void);
+
+// Record the time elapsed since start, returns the current time so that
+// consecutive stages can be chained
+uint64_t stats_record(Stage stage, uint64_t start);
+
+size_t stats_serialize(unsigned char *buf, size_t size);
+void stats_reset(void);
+
+#endif
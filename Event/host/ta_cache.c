@@ -0,0 +1,292 @@
+#include "ta_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "utils.h"
+
+#ifndef TA_DIR
+#define TA_DIR "/lib/optee_armtz"
+#endif
+
+#define SIDECAR_SUFFIX ".sha256"
+
+
+/*
+  Build the path of the binary of a TA
+
+  @return: 1 on success, 0 if it does not fit in size bytes
+*/
+static int ta_path(const TEEC_UUID *uuid, char *path, size_t size) {
+  int len = snprintf(path, size,
+            "%s/%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x.ta",
+            TA_DIR,
+            uuid->timeLow,
+            uuid->timeMid,
+            uuid->timeHiAndVersion,
+            uuid->clockSeqAndNode[0],
+            uuid->clockSeqAndNode[1],
+            uuid->clockSeqAndNode[2],
+            uuid->clockSeqAndNode[3],
+            uuid->clockSeqAndNode[4],
+            uuid->clockSeqAndNode[5],
+            uuid->clockSeqAndNode[6],
+            uuid->clockSeqAndNode[7]);
+
+  if(len < 0 || (size_t) len >= size) {
+    fprintf(stderr, "path of TA too long in %s\n", TA_DIR);
+    return 0;
+  }
+
+  return 1;
+}
+
+
+// Same for path followed by suffix
+static int path_with_suffix(char *out, size_t size, const char *path,
+                    const char *suffix) {
+  int len = snprintf(out, size, "%s%s", path, suffix);
+
+  if(len < 0 || (size_t) len >= size) {
+    fprintf(stderr, "path too long: %s%s\n", path, suffix);
+    return 0;
+  }
+
+  return 1;
+}
+
+
+static int hex_value(char c) {
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+
+/*
+  Write a file through a temporary one, so that it is either complete or
+  absent. The temporary name is unique: loads of the same TA may write the
+  file concurrently, the last rename wins
+
+  @return: 1 on success, 0 on error
+*/
+static int write_file(const char *path, const unsigned char *data, size_t size) {
+  char tmp[PATH_MAX];
+  FILE *file = NULL;
+  int fd;
+  int ok;
+
+  if(!path_with_suffix(tmp, sizeof(tmp), path, ".XXXXXX"))
+    return 0;
+
+  fd = mkstemp(tmp);
+  if(fd < 0 || fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0 ||
+      (file = fdopen(fd, "w")) == NULL) {
+    perror(tmp);
+    if(fd >= 0) {
+      close(fd);
+      unlink(tmp);
+    }
+    return 0;
+  }
+
+  ok = fwrite(data, 1, size, file) == size;
+  ok = fclose(file) == 0 && ok;
+
+  if(!ok || rename(tmp, path) != 0) {
+    perror(path);
+    unlink(tmp);
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+  Check the hash of an installed binary. The sidecar must not be older
+  than the binary: a binary replaced by other means is not trusted
+
+  @uuid: TA
+  @hash: expected SHA-256 of the binary
+
+  @return: 1 if the binary is installed with this hash, 0 otherwise
+*/
+int ta_cache_lookup(const TEEC_UUID *uuid, const unsigned char hash[SHA256_SIZE]) {
+  char path[PATH_MAX];
+  char sidecar[PATH_MAX];
+  char hex[2 * SHA256_SIZE];
+  struct stat ta_stat, sidecar_stat;
+  FILE *file;
+  size_t n;
+
+  if(!ta_path(uuid, path, sizeof(path)) ||
+      !path_with_suffix(sidecar, sizeof(sidecar), path, SIDECAR_SUFFIX))
+    return 0;
+
+  if(stat(path, &ta_stat) != 0 || stat(sidecar, &sidecar_stat) != 0 ||
+      sidecar_stat.st_mtime < ta_stat.st_mtime)
+    return 0;
+
+  file = fopen(sidecar, "r");
+  if(file == NULL)
+    return 0;
+
+  n = fread(hex, 1, sizeof(hex), file);
+  fclose(file);
+
+  if(n != sizeof(hex))
+    return 0;
+
+  for(int i = 0; i < SHA256_SIZE; i++) {
+    int high = hex_value(hex[2 * i]);
+    int low = hex_value(hex[2 * i + 1]);
+
+    if(high < 0 || low < 0 || ((high << 4) | low) != hash[i])
+      return 0;
+  }
+
+  return 1;
+}
+
+
+struct ta_upload {
+  TEEC_UUID uuid;
+  FILE *file;
+  Sha256Ctx sha;
+  int failed;
+  char tmp[PATH_MAX];
+};
+
+
+/*
+  Start receiving a TA binary. Every upload has its own temporary file, next
+  to the binary so that it can be renamed over it
+
+  @uuid: TA
+
+  @return: upload, NULL on error
+*/
+TaUpload *ta_upload_begin(const TEEC_UUID *uuid) {
+  TaUpload *upload = malloc_aligned(sizeof(TaUpload));
+  char path[PATH_MAX];
+  int fd;
+
+  if(upload == NULL)
+    return NULL;
+
+  if(!ta_path(uuid, path, sizeof(path)) ||
+      !path_with_suffix(upload->tmp, sizeof(upload->tmp), path, ".XXXXXX")) {
+    free(upload);
+    return NULL;
+  }
+
+  // mkstemp makes the file private, tee-supplicant may run as another user
+  fd = mkstemp(upload->tmp);
+  if(fd < 0 || fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0 ||
+      (upload->file = fdopen(fd, "w")) == NULL) {
+    perror(upload->tmp);
+    if(fd >= 0) {
+      close(fd);
+      unlink(upload->tmp);
+    }
+    free(upload);
+    return NULL;
+  }
+
+  upload->uuid = *uuid;
+  upload->failed = 0;
+  sha256_init(&upload->sha);
+  return upload;
+}
+
+
+int ta_upload_write(TaUpload *upload, const unsigned char *data, size_t size) {
+  if(upload->failed)
+    return 0;
+
+  sha256_update(&upload->sha, data, size);
+
+  if(fwrite(data, 1, size, upload->file) != size) {
+    perror(upload->tmp);
+    upload->failed = 1;
+  }
+
+  return !upload->failed;
+}
+
+
+void ta_upload_abort(TaUpload *upload) {
+  fclose(upload->file);
+  unlink(upload->tmp);
+  free(upload);
+}
+
+
+/*
+  Install a received TA binary and its sidecar. The sidecar is removed
+  first and written last, a failure in between leaves a binary that is not
+  trusted. A binary identical to the installed one is dropped
+
+  @upload: upload, freed
+
+  @return: 1 on success, 0 on error
+*/
+int ta_upload_finish(TaUpload *upload) {
+  char path[PATH_MAX];
+  char sidecar[PATH_MAX];
+  char line[PATH_MAX + 2 * SHA256_SIZE + 4];
+  unsigned char hash[SHA256_SIZE];
+  const char *name;
+  int len = 0;
+
+  if(fclose(upload->file) != 0 || upload->failed) {
+    perror(upload->tmp);
+    unlink(upload->tmp);
+    free(upload);
+    return 0;
+  }
+
+  sha256_final(&upload->sha, hash);
+
+  if(ta_cache_lookup(&upload->uuid, hash)) {
+    unlink(upload->tmp);
+    free(upload);
+    return 1;
+  }
+
+  if(!ta_path(&upload->uuid, path, sizeof(path)) ||
+      !path_with_suffix(sidecar, sizeof(sidecar), path, SIDECAR_SUFFIX)) {
+    unlink(upload->tmp);
+    free(upload);
+    return 0;
+  }
+  unlink(sidecar);
+
+  if(rename(upload->tmp, path) != 0) {
+    perror(path);
+    unlink(upload->tmp);
+    free(upload);
+    return 0;
+  }
+  free(upload);
+
+  // "<hex>  <file name>", as sha256sum -c expects
+  name = strrchr(path, '/') + 1;
+  for(int i = 0; i < SHA256_SIZE; i++)
+    len += snprintf(line + len, sizeof(line) - len, "%02x", hash[i]);
+  len += snprintf(line + len, sizeof(line) - len, "  %s\n", name);
+
+  // the binary is installed either way, it is only written again next time
+  write_file(sidecar, (const unsigned char *) line, len);
+  return 1;
+}
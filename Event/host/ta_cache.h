@@ -0,0 +1,33 @@
+#ifndef __TA_CACHE_H__
+#define __TA_CACHE_H__
+
+#include <stddef.h>
+
+#include "tee_client_api.h"
+#include "sha256.h"
+
+// TA binaries are installed as TA_DIR/<uuid>.ta, where tee-supplicant looks
+// for them. Each one has a sidecar <uuid>.ta.sha256 in sha256sum format,
+// written once the binary is complete, so that an image uploaded again is
+// recognized by its hash without being written.
+
+// Returns 1 if the installed binary of uuid has the given hash
+int ta_cache_lookup(const TEEC_UUID *uuid, const unsigned char hash[SHA256_SIZE]);
+
+// A binary being received. It is written to a temporary file and hashed as
+// it arrives, so it is never held in memory
+typedef struct ta_upload TaUpload;
+
+// Returns NULL if the temporary file cannot be created
+TaUpload *ta_upload_begin(const TEEC_UUID *uuid);
+
+// Returns 0 once a write has failed, the upload can then only be aborted
+int ta_upload_write(TaUpload *upload, const unsigned char *data, size_t size);
+
+// Installs the binary, unless the same one is installed already.
+// Returns 0 if it cannot be installed. The upload is freed either way.
+int ta_upload_finish(TaUpload *upload);
+
+void ta_upload_abort(TaUpload *upload);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef __TA_COMMANDS_H__
+#define __TA_COMMANDS_H__
+
+// Commands implemented by the TAs, see enclave_utils.c for their parameters
+#define TA_CMD_SET_KEY        0
+#define TA_CMD_ATTEST         1
+#define TA_CMD_HANDLE_INPUT   2
+#define TA_CMD_ENTRYPOINT     3
+#define TA_CMD_HANDLE_INPUT_BATCH 4
+
+#define TA_TAG_SIZE           16
+
+/*
+  Outputs of HANDLE_INPUT and ENTRYPOINT: params[0].value.b is their number
+  and params[3] holds their tags. Two layouts exist:
+
+  - legacy: params[1] is a [conn id u16] per output and params[2] a
+    [len u8 - data] record per output
+  - wide: the TA sets TA_OUTPUT_WIDE in params[0].value.a, params[1] is a
+    [conn id u16 - len u16] per output and params[2] the data back to back
+
+  value.a carries the input size (below 64 KB) on the way in, so a legacy TA
+  that leaves it untouched is never taken for a wide one.
+
+  A TA whose outputs do not fit returns TEEC_ERROR_SHORT_BUFFER with the
+  sizes it needs in the memrefs. The host grows its buffers and calls again,
+  the TA must not have changed its state in the failed call.
+*/
+#define TA_OUTPUT_WIDE        0x80000000u
+
+/*
+  HANDLE_INPUT_BATCH passes several inputs in one invocation, laid out like
+  wide outputs: params[0].value.b is their number and value.a the size of
+  their data, params[1] a [conn id u16 - len u16] per input, params[2] the
+  data back to back and params[3] the tags. The outputs of all of them are
+  returned as for HANDLE_INPUT, always in the wide layout.
+
+  The inputs are handled in order. A TA that fails the call must not have
+  handled any of them: a TA that does not know the command is given the
+  inputs again one HANDLE_INPUT each.
+*/
+
+#endif
@@ -2,8 +2,51 @@
 
 #include <stdlib.h>
 
+// Objects kept by a pool beyond this are given back to malloc
+#define POOL_MAX_FREE 4096
+
 void *malloc_aligned(size_t size) {
   size += size % 2;
 
   return malloc(size);
 }
+
+/*
+  Take an object from a pool, falling back to malloc when it is empty. Pools
+  are meant to be thread-local, so no locking is done
+
+  @pool: pool
+  @size: size of the objects of the pool
+
+  @return: object, NULL if OOM
+*/
+void *pool_alloc(ObjectPool *pool, size_t size) {
+  PoolObject *obj = pool->free;
+
+  if(obj == NULL)
+    return malloc_aligned(size < sizeof(PoolObject) ? sizeof(PoolObject) : size);
+
+  pool->free = obj->next;
+  pool->count--;
+  return obj;
+}
+
+/*
+  Give an object back to a pool. It may have been taken from the pool of
+  another thread
+
+  @pool: pool
+  @ptr: object from pool_alloc
+*/
+void pool_free(ObjectPool *pool, void *ptr) {
+  PoolObject *obj = ptr;
+
+  if(pool->count >= POOL_MAX_FREE) {
+    free(obj);
+    return;
+  }
+
+  obj->next = pool->free;
+  pool->free = obj;
+  pool->count++;
+}
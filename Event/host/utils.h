@@ -7,4 +7,17 @@
                                                 (((n<<16)>>24)<<16) | (n>>24))
 void *malloc_aligned(size_t size);
 
+// Cache of free objects of one size, recycled without going through malloc
+typedef struct pool_object {
+  struct pool_object *next;
+} PoolObject;
+
+typedef struct object_pool {
+  PoolObject *free;
+  size_t count;
+} ObjectPool;
+
+void *pool_alloc(ObjectPool *pool, size_t size);
+void pool_free(ObjectPool *pool, void *ptr);
+
 #endif
@@ -0,0 +1,360 @@
+/*
+  Stand-in for libteec, used to run and profile the event manager on a
+  machine without OP-TEE (cmake -DUSE_MOCK_TEEC=ON).
+
+  Every module behaves like the same TA:
+    0 set-key        accepts the key
+    1 attest         returns a MAC derived from the challenge
+    2 handle-input   produces MOCK_TEEC_INPUT_FANOUT outputs (default 0)
+    3 entrypoint     produces MOCK_TEEC_FANOUT outputs (default 1)
+    4 input batch    handle-input for each input, unless MOCK_TEEC_BATCH=0
+                     where it is rejected like by a TA that predates it
+
+  Outputs are sent round-robin on MOCK_TEEC_CONNS connections starting at
+  MOCK_TEEC_CONN_ID (defaults 1 and 0), and carry the first
+  MOCK_TEEC_OUTPUT_SIZE bytes (default 16) of the input, in the wide layout
+  of ta_commands.h if they are larger than 255 bytes or MOCK_TEEC_WIDE is
+  set. Buffers too small get TEEC_ERROR_SHORT_BUFFER. Each invocation
+  keeps the CPU busy for MOCK_TEEC_LATENCY_US microseconds (default 0),
+  like a world switch would, and opening a session for MOCK_TEEC_OPEN_US
+  (default 0), like the loading of a TA.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tee_client_api.h"
+#include "ta_commands.h"
+
+typedef struct mock_config {
+  int loaded;
+  unsigned long latency_us;
+  unsigned long open_us;
+  unsigned int fanout;
+  unsigned int input_fanout;
+  unsigned int conn_id;
+  unsigned int conns;
+  unsigned int output_size;
+  int wide;
+  int batch;
+} MockConfig;
+
+static MockConfig config;
+
+
+static unsigned long env_ulong(const char *name, unsigned long def) {
+  const char *value = getenv(name);
+
+  return value != NULL ? strtoul(value, NULL, 10) : def;
+}
+
+
+// Read once, InitializeContext is called before the workers start
+static void load_config(void) {
+  if(config.loaded)
+    return;
+
+  config.latency_us = env_ulong("MOCK_TEEC_LATENCY_US", 0);
+  config.open_us = env_ulong("MOCK_TEEC_OPEN_US", 0);
+  config.fanout = env_ulong("MOCK_TEEC_FANOUT", 1);
+  config.input_fanout = env_ulong("MOCK_TEEC_INPUT_FANOUT", 0);
+  config.conn_id = env_ulong("MOCK_TEEC_CONN_ID", 0);
+  config.conns = env_ulong("MOCK_TEEC_CONNS", 1);
+  config.output_size = env_ulong("MOCK_TEEC_OUTPUT_SIZE", 16);
+
+  if(config.conns == 0)
+    config.conns = 1;
+  config.wide = env_ulong("MOCK_TEEC_WIDE", 0) != 0;
+  config.batch = env_ulong("MOCK_TEEC_BATCH", 1) != 0;
+
+  if(config.output_size > 0xFFFF)
+    config.output_size = 0xFFFF;
+  if(config.output_size > 0xFF)
+    config.wide = 1;
+
+  config.loaded = 1;
+}
+
+
+// Busy wait: a real invocation occupies the calling core until it returns
+static void spin(unsigned long us) {
+  struct timespec start, now;
+
+  if(us == 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while((unsigned long) ((now.tv_sec - start.tv_sec) * 1000000L +
+                            (now.tv_nsec - start.tv_nsec) / 1000) < us);
+}
+
+
+/*
+  Resolve a memory reference parameter, whatever its type
+
+  @size: set to the size of the referenced region
+
+  @return: start of the region, NULL if the parameter is not a memref
+*/
+static unsigned char *param_buffer(TEEC_Operation *op, int i, size_t *size) {
+  TEEC_Parameter *param = &op->params[i];
+
+  switch(TEEC_PARAM_TYPE_GET(op->paramTypes, i)) {
+    case TEEC_MEMREF_TEMP_INPUT:
+    case TEEC_MEMREF_TEMP_OUTPUT:
+    case TEEC_MEMREF_TEMP_INOUT:
+      *size = param->tmpref.size;
+      return param->tmpref.buffer;
+    case TEEC_MEMREF_WHOLE:
+      *size = param->memref.parent->size;
+      return param->memref.parent->buffer;
+    case TEEC_MEMREF_PARTIAL_INPUT:
+    case TEEC_MEMREF_PARTIAL_OUTPUT:
+    case TEEC_MEMREF_PARTIAL_INOUT:
+      *size = param->memref.size;
+      return (unsigned char *) param->memref.parent->buffer +
+                param->memref.offset;
+    default:
+      *size = 0;
+      return NULL;
+  }
+}
+
+
+static TEEC_Result attest(TEEC_Operation *op) {
+  size_t challenge_size, mac_size;
+  unsigned char *challenge = param_buffer(op, 0, &challenge_size);
+  unsigned char *mac = param_buffer(op, 1, &mac_size);
+
+  if(challenge == NULL || mac == NULL || challenge_size < TA_TAG_SIZE)
+    return TEEC_ERROR_BAD_PARAMETERS;
+  if(mac_size < TA_TAG_SIZE)
+    return TEEC_ERROR_SHORT_BUFFER;
+
+  for(int i = 0; i < TA_TAG_SIZE; i++)
+    mac[i] = challenge[i] ^ 0x5a;
+
+  return TEEC_SUCCESS;
+}
+
+
+// Report the size a memref should have, or the size written to it
+static void set_param_size(TEEC_Operation *op, int i, size_t size) {
+  switch(TEEC_PARAM_TYPE_GET(op->paramTypes, i)) {
+    case TEEC_MEMREF_TEMP_INPUT:
+    case TEEC_MEMREF_TEMP_OUTPUT:
+    case TEEC_MEMREF_TEMP_INOUT:
+      op->params[i].tmpref.size = size;
+      break;
+    default:
+      op->params[i].memref.size = size;
+  }
+}
+
+
+/*
+  Emulate handle-input, batch and entrypoint calls: params[0].value.a is the
+  size of the inputs in params[2], a batch has params[0].value.b inputs
+  described in params[1]. The outputs are written as the TA would
+  (big-endian conn ids in params[1], [len u8 - data] records in params[2],
+  tags in params[3]) and their number is returned in params[0].value.b
+
+  @count: outputs per input
+*/
+static TEEC_Result produce_outputs(TEEC_Operation *op, unsigned int count,
+                    int batch) {
+  size_t conn_size, data_size, tag_size;
+  unsigned char *conn_ids = param_buffer(op, 1, &conn_size);
+  unsigned char *data = param_buffer(op, 2, &data_size);
+  unsigned char *tags = param_buffer(op, 3, &tag_size);
+  uint32_t input_size = op->params[0].value.a;
+  unsigned int inputs = batch ? op->params[0].value.b : 1;
+  int wide = config.wide || batch;
+  size_t entry_size = wide ? 4 : 2;
+  size_t record_size = config.output_size + (wide ? 0 : 1);
+  size_t total = (size_t) count * inputs;
+  size_t offset = 0, input_offset = 0;
+
+  if(conn_ids == NULL || data == NULL || tags == NULL || input_size > data_size ||
+      (batch && conn_size < inputs * 4))
+    return TEEC_ERROR_BAD_PARAMETERS;
+
+  if(conn_size < total * entry_size || data_size < total * record_size ||
+      tag_size < total * TA_TAG_SIZE) {
+    set_param_size(op, 1, total * entry_size);
+    set_param_size(op, 2, total * record_size);
+    set_param_size(op, 3, total * TA_TAG_SIZE);
+    return TEEC_ERROR_SHORT_BUFFER;
+  }
+
+  // the outputs overwrite the inputs
+  unsigned char *input = malloc(input_size + inputs * 4 + 1);
+  if(input == NULL)
+    return TEEC_ERROR_OUT_OF_MEMORY;
+  memcpy(input, data, input_size);
+
+  unsigned char *sizes = input + input_size;
+  if(batch)
+    memcpy(sizes, conn_ids, inputs * 4);
+
+  for(unsigned int n = 0; n < inputs; n++) {
+    size_t len = batch ? (size_t) ((sizes[4 * n + 2] << 8) | sizes[4 * n + 3]) :
+                         (size_t) input_size;
+
+    if(input_offset + len > input_size) {
+      free(input);
+      return TEEC_ERROR_BAD_PARAMETERS;
+    }
+
+    for(unsigned int i = 0; i < count; i++) {
+      unsigned int index = n * count + i;
+      unsigned char *entry = conn_ids + entry_size * index;
+      uint16_t conn_id = config.conn_id + i % config.conns;
+      size_t copy = len < config.output_size ? len : config.output_size;
+
+      entry[0] = conn_id >> 8;
+      entry[1] = conn_id & 0xFF;
+
+      if(wide) {
+        entry[2] = config.output_size >> 8;
+        entry[3] = config.output_size & 0xFF;
+      }
+      else {
+        data[offset++] = config.output_size;
+      }
+
+      memcpy(data + offset, input + input_offset, copy);
+      memset(data + offset + copy, 0, config.output_size - copy);
+      offset += config.output_size;
+
+      memset(tags + index * TA_TAG_SIZE, 0xa5, TA_TAG_SIZE);
+    }
+
+    input_offset += len;
+  }
+
+  free(input);
+
+  set_param_size(op, 1, total * entry_size);
+  set_param_size(op, 2, offset);
+  set_param_size(op, 3, total * TA_TAG_SIZE);
+  op->params[0].value.a = wide ? TA_OUTPUT_WIDE : 0;
+  op->params[0].value.b = total;
+  return TEEC_SUCCESS;
+}
+
+
+TEEC_Result TEEC_InitializeContext(const char *name, TEEC_Context *context) {
+  (void) name;
+  load_config();
+  memset(context, 0, sizeof(*context));
+  context->fd = -1;
+  return TEEC_SUCCESS;
+}
+
+
+void TEEC_FinalizeContext(TEEC_Context *context) {
+  (void) context;
+}
+
+
+TEEC_Result TEEC_OpenSession(TEEC_Context *context, TEEC_Session *session,
+                    const TEEC_UUID *destination, uint32_t connectionMethod,
+                    const void *connectionData, TEEC_Operation *operation,
+                    uint32_t *returnOrigin) {
+  static uint32_t next_session_id = 1;
+
+  (void) destination;
+  (void) connectionMethod;
+  (void) connectionData;
+  (void) operation;
+
+  spin(config.open_us);
+
+  session->ctx = context;
+  session->session_id = __atomic_fetch_add(&next_session_id, 1, __ATOMIC_RELAXED);
+
+  if(returnOrigin != NULL)
+    *returnOrigin = TEEC_ORIGIN_TRUSTED_APP;
+
+  return TEEC_SUCCESS;
+}
+
+
+void TEEC_CloseSession(TEEC_Session *session) {
+  (void) session;
+}
+
+
+TEEC_Result TEEC_InvokeCommand(TEEC_Session *session, uint32_t commandID,
+                    TEEC_Operation *operation, uint32_t *returnOrigin) {
+  TEEC_Result rc;
+  (void) session;
+
+  spin(config.latency_us);
+
+  if(returnOrigin != NULL)
+    *returnOrigin = TEEC_ORIGIN_TRUSTED_APP;
+
+  switch(commandID) {
+    case TA_CMD_SET_KEY:
+      rc = TEEC_SUCCESS;
+      break;
+    case TA_CMD_ATTEST:
+      rc = attest(operation);
+      break;
+    case TA_CMD_HANDLE_INPUT:
+      rc = produce_outputs(operation, config.input_fanout, 0);
+      break;
+    case TA_CMD_ENTRYPOINT:
+      rc = produce_outputs(operation, config.fanout, 0);
+      break;
+    case TA_CMD_HANDLE_INPUT_BATCH:
+      rc = config.batch ? produce_outputs(operation, config.input_fanout, 1) :
+                          TEEC_ERROR_NOT_SUPPORTED;
+      break;
+    default:
+      rc = TEEC_ERROR_BAD_PARAMETERS;
+  }
+
+  return rc;
+}
+
+
+TEEC_Result TEEC_RegisterSharedMemory(TEEC_Context *context,
+                    TEEC_SharedMemory *sharedMem) {
+  (void) context;
+  sharedMem->alloced_size = 0;
+  return TEEC_SUCCESS;
+}
+
+
+TEEC_Result TEEC_AllocateSharedMemory(TEEC_Context *context,
+                    TEEC_SharedMemory *sharedMem) {
+  size_t size = sharedMem->size ? sharedMem->size : 1;
+  (void) context;
+
+  sharedMem->buffer = malloc(size);
+  if(sharedMem->buffer == NULL)
+    return TEEC_ERROR_OUT_OF_MEMORY;
+
+  sharedMem->alloced_size = size;
+  return TEEC_SUCCESS;
+}
+
+
+void TEEC_ReleaseSharedMemory(TEEC_SharedMemory *sharedMemory) {
+  // registered memory belongs to the caller
+  if(sharedMemory->alloced_size != 0)
+    free(sharedMemory->buffer);
+
+  sharedMemory->buffer = NULL;
+  sharedMemory->alloced_size = 0;
+}
+
+
+void TEEC_RequestCancellation(TEEC_Operation *operation) {
+  (void) operation;
+}